@@ -31,6 +31,9 @@
 #include "boot_info.h"
 #include "mm/malloc.h"
 #include "utils/spinlock.h"
+#include "utils/qspinlock.h"
+#include "utils/math.h"
+#include "tlb.h"
 
 uint8_t kernel_stack[PG_SIZE] ALIGNED(PG_SIZE);
 boot_info_t vm_config = {.config_size = 0};
@@ -41,6 +44,71 @@ volatile bool virt_start = false;
 extern uint64_t _boot_start, _boot_pages;
 extern uint64_t _kernel_code_pages, _kernel_ro_pages, _kernel_rw_pages;
 
+#define for_each_mmap_entry(mmap, tag)                                       \
+  for (mmap = (tag)->entries;                                                \
+       (multiboot_uint8_t *) mmap < (multiboot_uint8_t *) (tag) + (tag)->size; \
+       mmap = (multiboot_memory_map_t *) ((unsigned long) mmap               \
+       + (tag)->entry_size))
+
+static inline uint64_t kernel_image_end(void)
+{
+  return (uint64_t) &_boot_start + ((uint64_t) &_boot_pages
+         + (uint64_t) &_kernel_code_pages + (uint64_t) &_kernel_ro_pages
+         + (uint64_t) &_kernel_rw_pages) * PG_SIZE;
+}
+
+/*
+ * end of a range that must survive boot and overlaps [begin, end),
+ * 0 if none: kernel image, multiboot info and modules
+ */
+static uint64_t boot_overlap(uint64_t mbi, uint64_t begin, uint64_t end)
+{
+  struct multiboot_tag *tag;
+  uint64_t mbi_end = mbi + *(uint32_t *) mbi;
+
+  if (begin < kernel_image_end() && end > (uint64_t) &_boot_start)
+    return kernel_image_end();
+  if (begin < mbi_end && end > mbi)
+    return mbi_end;
+
+  for (tag = (struct multiboot_tag *) (mbi + 8);
+       tag->type != MULTIBOOT_TAG_TYPE_END;
+       tag = (struct multiboot_tag *) ((multiboot_uint8_t *) tag
+             + ((tag->size + 7) & ~7))) {
+    if (tag->type == MULTIBOOT_TAG_TYPE_MODULE) {
+      struct multiboot_tag_module *mod = (struct multiboot_tag_module *) tag;
+      if (begin < mod->mod_end && end > mod->mod_start)
+        return mod->mod_end;
+    }
+  }
+
+  return 0;
+}
+
+/* free memory above 1MB for the physical allocator metadata, 0 if none */
+static uint64_t boot_find_meta(uint64_t mbi, struct multiboot_tag_mmap *tag,
+                               uint64_t size)
+{
+  multiboot_memory_map_t *mmap;
+  uint64_t start, end, next;
+
+  for_each_mmap_entry(mmap, tag) {
+    if (mmap->type != MULTIBOOT_MEMORY_AVAILABLE)
+      continue;
+
+    end = mmap->addr + mmap->len;
+    start = ceiling64(mmap->addr < 0x100000 ? 0x100000 : mmap->addr, PG_SIZE);
+    while (start + size <= end) {
+      next = boot_overlap(mbi, start, start + size);
+      if (next == 0)
+        return start;
+      start = ceiling64(next, PG_SIZE);
+    }
+  }
+
+  return 0;
+}
+
 
 void kernel_main(uint64_t magic, uint64_t mbi)
 {
@@ -48,6 +116,9 @@ void kernel_main(uint64_t magic, uint64_t mbi)
   uint8_t *rsdp = NULL;
   uint16_t selector;
   uint64_t mem_end, mem_limit = 0;
+  uint64_t meta, meta_size;
+  struct multiboot_tag_mmap *mmap_tag = NULL;
+  multiboot_memory_map_t *mmap;
   tss_t *tss_ptr;
 
   /* multiboot2 */
@@ -66,14 +137,11 @@ void kernel_main(uint64_t magic, uint64_t mbi)
              + ((tag->size + 7) & ~7))) {
     switch(tag->type) {
     case MULTIBOOT_TAG_TYPE_MMAP: {
-      multiboot_memory_map_t *mmap;
+      mmap_tag = (struct multiboot_tag_mmap *) tag;
 
-      for (mmap = ((struct multiboot_tag_mmap *) tag)->entries;
-           (multiboot_uint8_t *) mmap < (multiboot_uint8_t *) tag + tag->size;
-           mmap = (multiboot_memory_map_t *) ((unsigned long) mmap
-           + ((struct multiboot_tag_mmap *) tag)->entry_size)) {
+      for_each_mmap_entry(mmap, mmap_tag) {
         if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-          physical_free_range(mmap->addr, mmap->len);
+          physical_add_section(mmap->addr, mmap->len);
           mem_end = mmap->addr + mmap->len;
           if (mem_end > mem_limit)
             mem_limit = mem_end;
@@ -111,14 +179,31 @@ void kernel_main(uint64_t magic, uint64_t mbi)
 
   //TODO: check if SMP_BOOT_ADDR is free memory
 
-  physical_set_limit(mem_limit);
+  if (mmap_tag == NULL) {
+    printf("Missing memory map\n");
+    return;
+  }
+
+  /* physical allocator metadata, sized by the memory map */
+  meta_size = physical_meta_size(mem_limit);
+  meta = boot_find_meta(mbi, mmap_tag, meta_size);
+  if (meta == 0) {
+    printf("No room for physical memory metadata: %llX\n", meta_size);
+    return;
+  }
+  physical_init(mem_limit, meta, meta_size);
+
+  for_each_mmap_entry(mmap, mmap_tag) {
+    if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+      physical_free_range(mmap->addr, mmap->len);
+  }
+  physical_take_range(meta, meta_size);
+
   /* avoid page at address 0 */
   physical_take_range(0, PG_SIZE);
   /* mark kernel image */
-  physical_take_range((uint64_t) &_boot_start, ((uint64_t) &_boot_pages
-                      + (uint64_t) &_kernel_code_pages
-                      + (uint64_t) &_kernel_ro_pages
-                      + (uint64_t) &_kernel_rw_pages) * PG_SIZE);
+  physical_take_range((uint64_t) &_boot_start,
+                      kernel_image_end() - (uint64_t) &_boot_start);
 
   /* mark modules */
   for (tag = (struct multiboot_tag *) (mbi + 8);
@@ -141,9 +226,14 @@ void kernel_main(uint64_t magic, uint64_t mbi)
   if (vm_config.config_size == 0)
     panic("Missing config module");
 
+  physical_reserve_huge();
+  physical_init_colors();
+
   interrupt_init();
 
   vm_init();
+  vm_direct_map_init(mem_limit);
+  mmu_tlb_init();
 
   percpu_init();
 
@@ -162,6 +252,9 @@ void kernel_main(uint64_t magic, uint64_t mbi)
   load_tr(selector);
 
   malloc_init();
+#ifdef MALLOC_BENCH
+  malloc_bench();
+#endif
 
   /* parse config file */
   parse_boot_info(&vm_config);
@@ -205,6 +298,10 @@ void kernel_main(uint64_t magic, uint64_t mbi)
   spin_unlock(&mtrr_lock);
   while (mtrr_sync != 0) ;
 
+#ifdef LOCK_BENCH
+  lock_bench();
+#endif
+
   //TODO: flush cache
 
   virt_init(&vm_config);
@@ -214,6 +311,7 @@ void kernel_main(uint64_t magic, uint64_t mbi)
   printf("BSP %u: %u cores\n", get_pcpu_id(), g_cpus);
 
   interrupt_enable();
+  tlb_cpu_enter();
 
   while(1);
 }
@@ -68,6 +68,15 @@ uint64_t get_gdt_tss_base(uint16_t sel)
   return base;
 }
 
+/*
+ * per CPU: keep global pages (kernel image, mapping windows and the
+ * direct map) across CR3 loads
+ */
+void mmu_tlb_init(void)
+{
+  write_cr4(read_cr4() | CR4_PGE);
+}
+
 void mtrr_config(void)
 {
   uint8_t i, cnt;
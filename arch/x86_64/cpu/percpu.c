@@ -20,6 +20,7 @@
 #include "mm/physical.h"
 #include "asm_string.h"
 #include "msr.h"
+#include "numa.h"
 
 uint8_t *percpu_virt[MAX_CPUS];
 
@@ -44,6 +45,7 @@ void percpu_init(void)
   uint64_t start_frame;
   seg_desc *gdt_ptr = get_gdt();
   uint64_t start_virt;
+  uint8_t node;
 
   /* 
    * workaround: GCC will eliminate this if-statement when the check
@@ -68,7 +70,10 @@ void percpu_init(void)
   if (i == GDT_ENTRY_NR) 
     panic("out of GDT entries");
 
-  start_frame = alloc_phys_frames(pages);
+  /* BSP runs this before SRAT is parsed and gets node 0 */
+  node = numa_local_node();
+  numa_set_cpu_node(pcpu_counter, node);
+  start_frame = alloc_phys_frames_node(pages, node);
   if (start_frame == 0) 
     panic("out of physical memory");
 
@@ -5,12 +5,20 @@
 
 /* GCC built-in, __ATOMIC_SEQ_CST ensures inter-thread synchronization */
 
+/* type *src */
+#define atomic_load(src) __atomic_load_n((src), __ATOMIC_SEQ_CST)
 /* type *dst, type val */
 #define atomic_store(dst, val) __atomic_store_n((dst), (val), __ATOMIC_SEQ_CST)
 /* type *dst, type val */
 #define atomic_fetch_add(dst, val) __atomic_fetch_add((dst), (val), __ATOMIC_SEQ_CST)
+/* type *dst, type val */
+#define atomic_fetch_or(dst, val) __atomic_fetch_or((dst), (val), __ATOMIC_SEQ_CST)
+/* type *dst, type val */
+#define atomic_fetch_and(dst, val) __atomic_fetch_and((dst), (val), __ATOMIC_SEQ_CST)
 /* type *dst */
 #define atomic_increment(dst) __atomic_fetch_add((dst), 1, __ATOMIC_SEQ_CST)
+/* type *dst, type val, returns the old value */
+#define atomic_exchange(dst, val) __atomic_exchange_n((dst), (val), __ATOMIC_SEQ_CST)
 /* type *dst, *expected, type newval */
 #define atomic_cmp_xchg(dst, expected, newval) \
 __atomic_compare_exchange_n((dst), (expected), (newval), false, \
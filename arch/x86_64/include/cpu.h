@@ -78,6 +78,7 @@ typedef struct _idt_desc {
 uint16_t alloc_tss_desc(tss_t *tss_p);
 uint64_t get_gdt_tss_base(uint16_t sel);
 void mtrr_config(void);
+void mmu_tlb_init(void);
 
 static inline seg_desc *get_gdt(void)
 {
@@ -150,6 +151,21 @@ static inline void mem_barrier(void)
   __asm__ volatile("mfence" : : : "memory");
 }
 
+#define CR4_PGE (1 << 7)
+
+static inline uint64_t read_cr4(void)
+{
+  uint64_t tmp;
+  __asm__ volatile("movq %%cr4, %0" : "=r" (tmp));
+  return tmp;
+}
+
+static inline void write_cr4(uint64_t val)
+{
+  __asm__ volatile("movq %0, %%cr4" : : "r" (val) : "memory");
+}
+
+/* non-global entries */
 static inline void tlb_flush(void)
 {
   uint64_t tmp;
@@ -158,6 +174,19 @@ static inline void tlb_flush(void)
   mem_barrier();
 }
 
+/* every entry, global ones included */
+static inline void tlb_flush_global(void)
+{
+  uint64_t cr4 = read_cr4();
+
+  if (cr4 & CR4_PGE) {
+    write_cr4(cr4 & ~(uint64_t) CR4_PGE);
+    write_cr4(cr4);
+  } else
+    tlb_flush();
+  mem_barrier();
+}
+
 static inline uint64_t rdtsc(void)
 {
   uint32_t low, high;
@@ -16,6 +16,7 @@
 #define IA32_VMX_CR4_FIXED0           0x488
 #define IA32_VMX_CR4_FIXED1           0x489
 #define IA32_VMX_PROCBASED_CTLS2      0x48B
+#define IA32_VMX_EPT_VPID_CAP         0x48C
 #define IA32_VMX_TRUE_PINBASED_CTLS   0x48D
 #define IA32_VMX_TRUE_PROCBASED_CTLS  0x48E
 #define IA32_VMX_TRUE_EXIT_CTLS       0x48F
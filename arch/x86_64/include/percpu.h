@@ -86,4 +86,16 @@ static inline uint16_t get_pcpu_id(void)
   return percpu_read(pcpu_id);
 }
 
+/*
+ * false until percpu_init has run on this CPU: FS is still the
+ * data segment then, and %fs accesses hit another CPU's area
+ */
+static inline bool percpu_ready(void)
+{
+  uint16_t fs;
+
+  __asm__ volatile("movw %%fs, %0" : "=r" (fs));
+  return fs >= (GDT_START << 3);
+}
+
 #endif
@@ -0,0 +1,33 @@
+#ifndef _TLB_H_
+#define _TLB_H_
+
+#include "types.h"
+#include "utils/spinlock.h"
+
+/* IPI vector of TLB shootdowns */
+#define TLB_VECTOR 0xF0
+/* pages queued on a CPU before it does a full flush instead */
+#define TLB_QUEUE_MAX 32
+
+/*
+ * invalidations pending on a CPU: senders queue pages and bump 'gen',
+ * the CPU drains the queue and publishes the generation it reached
+ * in 'done'
+ */
+typedef struct _tlb_queue {
+  spinlock_t lock;
+  uint32_t count;
+  bool full;  /* flush the whole TLB */
+  bool pending;  /* IPI sent and not handled yet */
+  uint64_t gen;
+  uint64_t done;
+  uint64_t va[TLB_QUEUE_MAX];
+} ALIGNED(64) tlb_queue_t;
+
+extern void tlb_shootdown(void *va, uint64_t num, uint64_t size);
+extern void tlb_invalidate_range(void *va, uint64_t num, uint64_t size);
+extern void tlb_shootdown_handler(void);
+extern void tlb_cpu_enter(void);
+extern void tlb_cpu_leave(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "types.h"
 #include "boot_info.h"
 #include "utils/spinlock.h"
+#include "utils/rwlock.h"
 #include "cpu.h"
 
 #define VM_NONE UINT16_MAX
@@ -158,6 +159,43 @@
 #define EPT_TYPE_UC 0
 #define EPT_TYPE_WB 6
 
+/* uses of the frames owned by a VM */
+#define VM_MEM_RAM 0
+#define VM_MEM_EPT 1
+#define VM_MEM_VMX 2  /* VMCS and VMXON pages */
+#define VM_MEM_TYPES 3
+
+/* allocator an owned range goes back to on release */
+#define VM_SRC_FRAMES 0
+#define VM_SRC_HUGE 1
+#define VM_SRC_COLOR 2
+
+/* quotas from config.mk, 0 means no limit */
+#ifndef VIRT_RAM_QUOTA
+#define VIRT_RAM_QUOTA 0  /* MB */
+#endif
+#ifndef VIRT_EPT_QUOTA
+#define VIRT_EPT_QUOTA 0  /* frames */
+#endif
+
+/* range of frames owned by a VM */
+typedef struct _vm_mem_rec {
+  uint64_t paddr;
+  uint64_t frames;
+  uint8_t type;
+  uint8_t src;
+  uint32_t unit;  /* frames per allocation, released one unit at a time */
+} vm_mem_rec_t;
+
+#define VM_MEM_RECS 32
+
+/* owned ranges of a VM, in blocks from a kmem cache, newest block first */
+typedef struct _vm_mem_blk {
+  vm_mem_rec_t recs[VM_MEM_RECS];
+  uint32_t count;
+  struct _vm_mem_blk *next;
+} vm_mem_blk_t;
+
 typedef struct _vm_struct_t {
   uint16_t vm_id;
   char name[BOOT_STRING_MAX];
@@ -171,11 +209,30 @@ typedef struct _vm_struct_t {
   uint64_t vmcs_paddr[MAX_CPUS];
   uint64_t extra_paddr;
   uint64_t extra_size;  /* byte */
+  uint8_t node;  /* NUMA node of the first pCPU */
+  uint64_t color_mask;  /* LLC page colors of guest RAM */
+  uint64_t mem_used[VM_MEM_TYPES];  /* frames */
+  uint64_t mem_quota[VM_MEM_TYPES];  /* frames, 0 for no limit */
+  vm_mem_blk_t *mem_recs;
   spinlock_t lock;
 } vm_struct_t;
 
+/*
+ * the VM table: vm_structs and cpu_to_vm, guarded by vm_table_lock,
+ * which prefers writers so a vCPU stopping is not held off by CPUs
+ * still setting up; fields of one VM are under its own lock
+ */
 extern vm_struct_t *vm_structs;
 extern uint16_t cpu_to_vm[MAX_CPUS];
+extern rwlock_t vm_table_lock;
+
+/* VM run by 'cpu', NULL if none, vm_table_lock held */
+static inline vm_struct_t *virt_cpu_to_vm(uint16_t cpu)
+{
+  uint16_t vm_id = cpu_to_vm[cpu];
+
+  return vm_id == VM_NONE ? NULL : &vm_structs[vm_id];
+}
 
 #define virt_check_error(flags)   \
 do {                              \
@@ -217,6 +274,31 @@ static inline void vmptrld(uint64_t paddr)
   __asm__ volatile("vmptrld %0" : : "m" (paddr) : "cc");
 }
 
+static inline uint64_t vmptrst(void)
+{
+  uint64_t paddr;
+
+  __asm__ volatile("vmptrst %0" : "=m" (paddr));
+  return paddr;
+}
+
+static inline void vmxoff(void)
+{
+  __asm__ volatile("vmxoff" : : : "cc");
+}
+
 uint64_t virt_pg_table_setup(vm_struct_t *vm);
 
+void virt_mem_init(vm_struct_t *vm);
+uint64_t virt_alloc_frames(vm_struct_t *vm, uint8_t type, uint64_t num,
+                           uint64_t align);
+uint64_t virt_alloc_lowmem_frame(vm_struct_t *vm);
+uint64_t virt_alloc_zeroed_frame(vm_struct_t *vm, uint8_t type, uint8_t node);
+uint64_t virt_alloc_huge_frame(vm_struct_t *vm, uint64_t size);
+uint64_t virt_alloc_color_frame(vm_struct_t *vm);
+bool virt_take_range(vm_struct_t *vm, uint64_t begin, uint64_t length);
+uint64_t virt_mem_left(vm_struct_t *vm, uint8_t type);
+void virt_vm_release(vm_struct_t *vm);
+void virt_mem_dump(vm_struct_t *vm);
+
 #endif
@@ -16,6 +16,10 @@
 #define LARGE_PG_SIZE (1 << LARGE_PG_BITS)
 #define LARGE_PG_MASK (~((uint64_t) LARGE_PG_SIZE - 1))
 
+#define HUGE_PG_BITS 30
+#define HUGE_PG_SIZE ((uint64_t) 1 << HUGE_PG_BITS)
+#define HUGE_PG_MASK (~(HUGE_PG_SIZE - 1))
+
 /* flags of page table entry */
 #define PGT_P   0x1
 #define PGT_RW  0x2
@@ -33,6 +37,8 @@
 #define PDT_PAT 0x1000
 
 #define PGT_MASK ((uint64_t) 0xFFFFFFFFFFFFF000)
+/* physical address bits of an entry */
+#define PGT_ADDR_MASK ((uint64_t) 0x000FFFFFFFFFF000)
 
 /*
  * Follows MALLOC_END, this 2MB is
@@ -40,24 +46,56 @@
  */
 #define KERNEL_MAPPING_BASE MALLOC_END
 /*
- * From LG_PG_BASE to LG_PG_LIMIT
- * is for dynamic mapping of 2MB pages
+ * From KMAP_BASE, KMAP_SLOTS 4KB pages per CPU
+ * for short-lived mappings, see kmap_atomic
+ */
+#define KMAP_BASE (KERNEL_MAPPING_BASE + 0x200000)
+#define KMAP_SLOTS 16
+#define KMAP_LIMIT (KMAP_BASE + (((uint64_t) MAX_CPUS * KMAP_SLOTS) << PG_BITS))
+/*
+ * RAM up to the memory limit is mapped from DIRECT_MAP_BASE
+ * with 1GB pages, or 2MB if not supported, non-executable
  */
-#define LG_PG_BASE (KERNEL_MAPPING_BASE + 0x200000)
-#define LG_PG_LIMIT ((uint64_t) 0x2000000)
+#define DIRECT_MAP_BASE ((uint64_t) 0xFFFF800000000000)
+#define DIRECT_MAP_SIZE ((uint64_t) 1 << 46)
+/* vmap region, 512GB after the direct map: 4KB mappings that do not fit the window */
+#define VMAP_BASE (DIRECT_MAP_BASE + DIRECT_MAP_SIZE)
+#define VMAP_LIMIT (VMAP_BASE + ((uint64_t) 1 << 39))
 
 extern void vm_init(void);
 extern void *vm_map_page(uint64_t frame, uint64_t flags);
 extern void *vm_map_pages(uint64_t frame, uint64_t num, uint64_t flags);
 extern uint64_t vm_unmap_page(void *va);
 extern uint64_t vm_unmap_pages(void *va, uint64_t num);
+extern void vm_unmap_free_pages(void *va, uint64_t num);
 extern void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr);
 extern void vm_map_large_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr);
-extern void *vm_map_large_page(uint64_t frame, uint64_t flags);
-extern void *vm_map_large_pages(uint64_t frame, uint64_t num, uint64_t flags);
-extern uint64_t vm_unmap_large_page(void *va);
-extern uint64_t vm_unmap_large_pages(void *va, uint64_t num);
 extern void vm_check_mapping(uint64_t *addr);
+extern void *kmap_atomic(uint64_t frame, uint64_t flags);
+extern void kunmap_atomic(void *va);
+extern void vm_direct_map_init(uint64_t limit);
+
+/* physically contiguous piece of a virtual range */
+typedef struct _vm_sg {
+  uint64_t paddr;
+  uint64_t size;
+} vm_sg_t;
+
+extern uint64_t vm_virt_to_phys(void *va);
+extern uint32_t vm_virt_to_phys_sg(void *va, uint64_t size, vm_sg_t *sg,
+                                   uint32_t max);
+
+/* frames below the memory limit only */
+static inline void *phys_to_virt(uint64_t paddr)
+{
+  return (void *) (paddr + DIRECT_MAP_BASE);
+}
+
+/* direct map addresses only */
+static inline uint64_t virt_to_phys(void *va)
+{
+  return (uint64_t) va - DIRECT_MAP_BASE;
+}
 
 static inline void invalidate_page(void *va)
 {
@@ -23,6 +23,7 @@
 #include "cpu.h"
 #include "interrupt.h"
 #include "utils/screen.h"
+#include "utils/seqlock.h"
 
 /* Default LAPIC address: 0xFEE00000 */
 uint8_t *lapic_addr = (uint8_t *) 0xFEE00000;
@@ -33,6 +34,8 @@ uint32_t gsi_base = 0;
 static uint32_t num_gsi = 0;
 static uint32_t tsc_freq = 0;
 static uint8_t lapic_phys_ids[MAX_CPUS];
+/* IDs are read when sending IPIs, written as each CPU comes up */
+static seqlock_t lapic_ids_lock = SEQLOCK_UNLOCKED;
 
 static inline void lapic_write32(uint16_t offset, uint32_t data)
 {
@@ -96,7 +99,15 @@ static inline uint8_t lapic_get_phys_id_raw(void)
 /* return LAPIC ID */
 uint8_t lapic_get_phys_id(uint32_t cpu)
 {
-  return lapic_phys_ids[cpu];
+  uint32_t seq;
+  uint8_t id;
+
+  do {
+    seq = read_seqbegin(&lapic_ids_lock);
+    id = lapic_phys_ids[cpu];
+  } while (read_seqretry(&lapic_ids_lock, seq));
+
+  return id;
 }
 
 void lapic_eoi(void)
@@ -152,7 +163,9 @@ void lapic_init(void)
   lapic_write32(LAPIC_LVTE, 0x10000);  /* disable error interrupts */
   lapic_write32(LAPIC_SPIV, 0x0010F);  /* enable APIC: spurious vector = 0xF */
 
+  write_seqlock(&lapic_ids_lock);
   lapic_phys_ids[cpu] = lapic_get_phys_id_raw();
+  write_sequnlock(&lapic_ids_lock);
 }
 
 void ioapic_init(void)
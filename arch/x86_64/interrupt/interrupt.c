@@ -21,6 +21,7 @@
 #include "utils/screen.h"
 #include "vm.h"
 #include "apic.h"
+#include "tlb.h"
 
 typedef struct _hw_regs {
   uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
@@ -102,6 +103,11 @@ void exp_handler(uint64_t irq, hw_regs_t *regs)
 
 void isr_handler(uint64_t irq)
 {
+  if (irq == TLB_VECTOR) {
+    tlb_shootdown_handler();
+    return;
+  }
+
   printf("interrupt %u\n", irq);
   lapic_eoi();
 }
@@ -0,0 +1,190 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tlb.h"
+#include "vm.h"
+#include "apic.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "interrupt.h"
+#include "atomic.h"
+
+/*
+ * TLB shootdown: a CPU that clears page table entries invalidates
+ * them locally, then queues the pages on every other CPU in tlb_cpus
+ * and sends TLB_VECTOR to those without an IPI in flight, so one IPI
+ * covers all pages queued until it is handled.
+ *
+ * tlb_cpus holds the CPUs that may cache host translations. All of
+ * them share one PML4T and any may have touched a shared mapping, so
+ * every member is targeted; per-CPU kmap slots never need a
+ * shootdown. A CPU joins with a full flush and leaves before
+ * entering a guest: without VPID, VM exits flush the TLB anyway.
+ *
+ * A member may run with interrupts off, as the VM-exit path does:
+ * it answers queued shootdowns while waiting on its own, and an
+ * initiator holds no lock while it waits, so such a CPU never spins
+ * on anything its initiators need to finish.
+ */
+static uint64_t tlb_cpus[(MAX_CPUS + 63) / 64];
+/* CPUs in tlb_cpus, none during early boot */
+static uint32_t tlb_count = 0;
+static tlb_queue_t tlb_queues[MAX_CPUS];
+
+static inline bool tlb_cpu_active(uint16_t cpu)
+{
+  return (atomic_load(&tlb_cpus[cpu >> 6]) >> (cpu & 63)) & 1;
+}
+
+/* drain the queue of the running CPU */
+static void tlb_process_local(void)
+{
+  tlb_queue_t *q = &tlb_queues[get_pcpu_id()];
+  uint64_t flag;
+  uint32_t i;
+
+  /* the IPI handler takes the same lock */
+  interrupt_disable_save(&flag);
+  spin_lock(&q->lock);
+  if (q->full)
+    tlb_flush_global();
+  else {
+    for (i = 0; i < q->count; i++)
+      invalidate_page((void *) q->va[i]);
+  }
+  q->count = 0;
+  q->full = false;
+  q->pending = false;
+  atomic_store(&q->done, q->gen);
+  spin_unlock(&q->lock);
+  interrupt_enable_restore(flag);
+}
+
+/* queue the pages on 'cpu', return the generation to wait for */
+static uint64_t tlb_queue_pages(uint16_t cpu, uint64_t va, uint64_t num,
+                                uint64_t size)
+{
+  tlb_queue_t *q = &tlb_queues[cpu];
+  uint64_t i, gen, flag;
+  bool send;
+
+  interrupt_disable_save(&flag);
+  spin_lock(&q->lock);
+  if (q->count + num > TLB_QUEUE_MAX)
+    q->full = true;
+  if (!q->full) {
+    for (i = 0; i < num; i++)
+      q->va[q->count++] = va + i * size;
+  }
+  gen = ++q->gen;
+  send = !q->pending;
+  q->pending = true;
+  spin_unlock(&q->lock);
+  interrupt_enable_restore(flag);
+
+  if (send)
+    lapic_send_ipi(lapic_get_phys_id(cpu), TLB_VECTOR);
+  return gen;
+}
+
+/*
+ * invalidate 'num' pages of 'size' bytes from 'va' on the other CPUs,
+ * after the entries are cleared and invalidated locally
+ */
+void tlb_shootdown(void *va, uint64_t num, uint64_t size)
+{
+  uint64_t gens[MAX_CPUS];
+  uint16_t self, cpu;
+  bool any = false;
+
+  if (num == 0 || atomic_load(&tlb_count) == 0)
+    return;
+
+  self = get_pcpu_id();
+
+  for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+    gens[cpu] = 0;
+    if (cpu == self || !tlb_cpu_active(cpu))
+      continue;
+    gens[cpu] = tlb_queue_pages(cpu, (uint64_t) va, num, size);
+    any = true;
+  }
+  if (!any)
+    return;
+
+  /* answer shootdowns aimed at us while waiting, interrupts may be off */
+  for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+    while (gens[cpu] && atomic_load(&tlb_queues[cpu].done) < gens[cpu]
+           && tlb_cpu_active(cpu)) {
+      if (tlb_cpu_active(self))
+        tlb_process_local();
+      pause();
+    }
+  }
+}
+
+/*
+ * invalidate 'num' pages of 'size' bytes from 'va' on all CPUs, with
+ * a single full flush per CPU past TLB_QUEUE_MAX pages
+ */
+void tlb_invalidate_range(void *va, uint64_t num, uint64_t size)
+{
+  uint64_t i;
+
+  if (num > TLB_QUEUE_MAX)
+    tlb_flush_global();
+  else {
+    for (i = 0; i < num; i++)
+      invalidate_page((uint8_t *) va + i * size);
+  }
+
+  tlb_shootdown(va, num, size);
+}
+
+/* TLB_VECTOR */
+void tlb_shootdown_handler(void)
+{
+  tlb_process_local();
+  lapic_eoi();
+}
+
+/* start answering shootdowns, see the IF rules above */
+void tlb_cpu_enter(void)
+{
+  uint16_t cpu = get_pcpu_id();
+
+  if (tlb_cpu_active(cpu))
+    return;
+  atomic_fetch_or(&tlb_cpus[cpu >> 6], (uint64_t) 1 << (cpu & 63));
+  atomic_increment(&tlb_count);
+  /* anything unmapped before joining */
+  tlb_flush_global();
+  tlb_process_local();
+}
+
+/* stop answering shootdowns, before VM entry */
+void tlb_cpu_leave(void)
+{
+  uint16_t cpu = get_pcpu_id();
+
+  if (!tlb_cpu_active(cpu))
+    return;
+  atomic_fetch_and(&tlb_cpus[cpu >> 6], ~((uint64_t) 1 << (cpu & 63)));
+  atomic_fetch_add(&tlb_count, -1);
+  tlb_process_local();
+}
@@ -22,8 +22,15 @@
 #include "debug.h"
 #include "asm_string.h"
 #include "utils/spinlock.h"
+#include "utils/qspinlock.h"
+#include "percpu.h"
+#include "tlb.h"
+#include "mm/vrange.h"
+#include "cpu.h"
+#include "utils/math.h"
+#include "atomic.h"
 
-static spinlock_t pg_lock = SPINLOCK_UNLOCKED;
+static qspinlock_t pg_lock = QSPINLOCK_UNLOCKED;
 
 /* canonical address, level 0-3: pml4t to pt */
 static uint64_t *get_paging_struct_vaddr(uint64_t *addr, uint8_t level)
@@ -55,7 +62,7 @@ void vm_check_mapping(uint64_t *addr)
   uint64_t *pml4t, *pdpt, *pdt, *pt;
   uint64_t entry;
 
-  spin_lock(&pg_lock);
+  qspin_lock(&pg_lock);
 
   pml4t = get_paging_struct_vaddr(addr, 0);
   entry = ((uint64_t) addr & 0xFF8000000000) >> 39;
@@ -70,118 +77,314 @@ void vm_check_mapping(uint64_t *addr)
   entry = ((uint64_t) addr & 0x1FF000) >> 12;
   printf("PT entry: %llX\n", pt[entry]);
 
-  spin_unlock(&pg_lock);
+  qspin_unlock(&pg_lock);
 }
 
-void *vm_map_page(uint64_t frame, uint64_t flags)
+/*
+ * Translation without pg_lock: entries are read once each, top down,
+ * and a level is only read through the recursive mapping once the
+ * entry above it is present; page tables are never freed, so a racing
+ * unmap can only make the result stale
+ */
+
+/* RAM mapped from DIRECT_MAP_BASE, set by vm_direct_map_init */
+static uint64_t direct_map_limit = 0;
+
+/*
+ * physical address of 'va' and the size of the leaf mapping it
+ * in 'leaf', 0 if not mapped
+ */
+static uint64_t vm_walk(uint64_t va, uint64_t *leaf)
 {
-  uint64_t i;
-  void *va;
-  uint64_t *pt;
+  uint64_t entry;
 
-  spin_lock(&pg_lock);
+  entry = atomic_load(get_paging_struct_vaddr((uint64_t *) va, 0)
+                      + ((va >> 39) & PG_TABLE_MASK));
+  if ((entry & PGT_P) == 0)
+    return 0;
+
+  entry = atomic_load(get_paging_struct_vaddr((uint64_t *) va, 1)
+                      + ((va >> HUGE_PG_BITS) & PG_TABLE_MASK));
+  if ((entry & PGT_P) == 0)
+    return 0;
+  if (entry & PDT_PS) {
+    *leaf = HUGE_PG_SIZE;
+    return (entry & PGT_ADDR_MASK & HUGE_PG_MASK) | (va & ~HUGE_PG_MASK);
+  }
 
-  pt = get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 3);
+  entry = atomic_load(get_paging_struct_vaddr((uint64_t *) va, 2)
+                      + ((va >> LARGE_PG_BITS) & PG_TABLE_MASK));
+  if ((entry & PGT_P) == 0)
+    return 0;
+  if (entry & PDT_PS) {
+    *leaf = LARGE_PG_SIZE;
+    return (entry & PGT_ADDR_MASK & LARGE_PG_MASK) | (va & ~LARGE_PG_MASK);
+  }
+
+  entry = atomic_load(get_paging_struct_vaddr((uint64_t *) va, 3)
+                      + ((va >> PG_BITS) & PG_TABLE_MASK));
+  if ((entry & PGT_P) == 0)
+    return 0;
+  *leaf = PG_SIZE;
+  return (entry & PGT_ADDR_MASK) | (va & ~PG_MASK);
+}
+
+/* physical address of 'va', 0 if not mapped */
+uint64_t vm_virt_to_phys(void *va)
+{
+  uint64_t addr = (uint64_t) va;
+  uint64_t leaf;
 
-  for (i = 0; i < PG_TABLE_ENTRIES; i++) {
-    if (!(pt[i] & PGT_P)) {
-      pt[i] = frame | flags;
-      va = (void *) (KERNEL_MAPPING_BASE + (i << PG_BITS));
-      spin_unlock(&pg_lock);
-      return va;
+  if (addr >= DIRECT_MAP_BASE && addr < DIRECT_MAP_BASE + direct_map_limit)
+    return virt_to_phys(va);
+
+  return vm_walk(addr, &leaf);
+}
+
+/*
+ * fill 'sg' with the physically contiguous pieces of the 'size' bytes
+ * from 'va', return the number of entries, 0 if part of the range is
+ * not mapped or it takes more than 'max' entries
+ */
+uint32_t vm_virt_to_phys_sg(void *va, uint64_t size, vm_sg_t *sg,
+                            uint32_t max)
+{
+  uint64_t addr = (uint64_t) va;
+  uint64_t end = addr + size;
+  uint64_t paddr, leaf, len;
+  uint32_t num = 0;
+
+  while (addr < end) {
+    paddr = vm_walk(addr, &leaf);
+    if (paddr == 0)
+      return 0;
+
+    /* up to the end of the leaf */
+    len = leaf - (addr & (leaf - 1));
+    if (len > end - addr)
+      len = end - addr;
+
+    if (num > 0 && sg[num - 1].paddr + sg[num - 1].size == paddr)
+      sg[num - 1].size += len;
+    else {
+      if (num == max)
+        return 0;
+      sg[num].paddr = paddr;
+      sg[num].size = len;
+      num++;
     }
+
+    addr += len;
   }
 
-  spin_unlock(&pg_lock);
-  return NULL;
+  return num;
 }
 
-/* map contiguous physical frames to contiguous virtual memory */
+/*
+ * Free slots of the 4KB mapping window, one bit per PTE, set while
+ * used. A slot belongs to its mapper once allocated, so page table
+ * entries are written without slot_lock, which only covers the bitmap.
+ */
+#define PG_SLOTS PG_TABLE_ENTRIES
+
+static uint64_t pg_slots[PG_SLOTS / 64];
+static spinlock_t slot_lock = SPINLOCK_UNLOCKED;
+
+/* 4KB mappings that do not fit the window */
+static vrange_t vmap_small;
+
+/* first run of 'num' free slots out of 'limit', 'limit' if none */
+static uint64_t slot_find(uint64_t *map, uint64_t limit, uint64_t num)
+{
+  uint64_t pos = 0, end, data;
+
+  while (pos + num <= limit) {
+    /* skip to the next free slot */
+    data = ~map[pos >> 6] & (UINT64_MAX << (pos & 63));
+    if (data == 0) {
+      pos = ((pos >> 6) + 1) << 6;
+      continue;
+    }
+    pos = (pos & ~(uint64_t) 63) + count_trailing_zeros_bit64(data);
+    if (pos + num > limit)
+      break;
+
+    for (end = pos + 1; end < pos + num; end++) {
+      if (bitmap64_check_bit(map, end))
+        break;
+    }
+    if (end == pos + num)
+      return pos;
+    pos = end + 1;
+  }
+
+  return limit;
+}
+
+/* reserve 'num' contiguous slots, return the first, 'limit' if none */
+static uint64_t slot_alloc(uint64_t *map, uint64_t limit, uint64_t num)
+{
+  uint64_t pos;
+
+  spin_lock(&slot_lock);
+  pos = slot_find(map, limit, num);
+  if (pos != limit)
+    bitmap64_set_range(map, pos, num);
+  spin_unlock(&slot_lock);
+
+  return pos;
+}
+
+static void slot_free(uint64_t *map, uint64_t pos, uint64_t num)
+{
+  spin_lock(&slot_lock);
+  bitmap64_clear_range(map, pos, num);
+  spin_unlock(&slot_lock);
+}
+
+void *vm_map_page(uint64_t frame, uint64_t flags)
+{
+  return vm_map_pages(frame, 1, flags);
+}
+
+/*
+ * map contiguous physical frames to contiguous virtual memory,
+ * in the 4KB window if there is room, else in the vmap region
+ */
 void *vm_map_pages(uint64_t frame, uint64_t num, uint64_t flags)
 {
-  uint64_t i, j;
-  void *va;
-  uint64_t count = 0;
+  uint64_t i, j, va;
   uint64_t *pt;
 
   if (num < 1) return NULL;
 
-  spin_lock(&pg_lock);
+  i = num <= PG_SLOTS ? slot_alloc(pg_slots, PG_SLOTS, num) : PG_SLOTS;
+  if (i == PG_SLOTS) {
+    va = vrange_alloc(&vmap_small, num << PG_BITS, 0);
+    if (va == 0)
+      return NULL;
+    /* page tables of the region are allocated on first use */
+    for (j = 0; j < num; j++)
+      vm_map_page_unrestricted(frame + (j << PG_BITS), flags | PGT_G,
+                               va + (j << PG_BITS));
+    return (void *) va;
+  }
 
   pt = get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 3);
-
-  for (i = 0; i < PG_TABLE_ENTRIES - num + 1; i++) {
-    if (!(pt[i] & PGT_P)) {
-      count++;
-
-      for (j = i + 1; j < i + num; j++) {
-        if (!(pt[j] & PGT_P))
-          count++;
-        else
-          break;
-      }
-
-      if (count == num) {
-        for (j = i; j < i + num; j++) {
-          pt[j] = frame | flags;
-          frame += PG_SIZE;
-        }
-
-        va = (void *) (KERNEL_MAPPING_BASE + (i << PG_BITS));
-        spin_unlock(&pg_lock);
-        return va;
-      } else {
-        i = j + 1;
-        count = 0;
-      }
-    }
+  for (j = i; j < i + num; j++) {
+    pt[j] = frame | flags | PGT_G;
+    frame += PG_SIZE;
   }
 
-  spin_unlock(&pg_lock);
-  return NULL;
+  return (void *) (KERNEL_MAPPING_BASE + (i << PG_BITS));
 }
 
 uint64_t vm_unmap_page(void *va)
 {
-  uint64_t frame;
+  return vm_unmap_pages(va, 1);
+}
+
+/*
+ * clear the 'num' page table entries from 'va' and invalidate them
+ * with one flush, return the first frame; the page tables of a range
+ * are contiguous in the recursive mapping
+ */
+static uint64_t vm_clear_range(void *va, uint64_t num)
+{
+  uint64_t *pt = get_paging_struct_vaddr((uint64_t *) va, 3);
+  uint64_t i = (((uint64_t) va) >> PG_BITS) & PG_TABLE_MASK;
+  uint64_t frame = pt[i] & PGT_ADDR_MASK;
+  uint64_t j;
+
+  for (j = 0; j < num; j++)
+    pt[i + j] = 0;
+  tlb_invalidate_range(va, num, PG_SIZE);
+
+  return frame;
+}
+
+/*
+ * unmap 'num' pages from 'va' and free their frames, which need not
+ * be contiguous: entries keep their frame while not present, until
+ * the range is flushed everywhere
+ */
+void vm_unmap_free_pages(void *va, uint64_t num)
+{
+  uint64_t *pt = get_paging_struct_vaddr((uint64_t *) va, 3);
+  uint64_t i = (((uint64_t) va) >> PG_BITS) & PG_TABLE_MASK;
+  uint64_t j;
+
+  for (j = 0; j < num; j++)
+    pt[i + j] &= ~(uint64_t) PGT_P;
+  tlb_invalidate_range(va, num, PG_SIZE);
+
+  for (j = 0; j < num; j++) {
+    free_phys_frame(pt[i + j] & PGT_ADDR_MASK);
+    pt[i + j] = 0;
+  }
+}
+
+/*
+ * Per-CPU temporary mappings: each CPU owns KMAP_SLOTS page table
+ * entries from KMAP_BASE, used as a stack. Nothing else touches them,
+ * so mapping needs no lock and unmapping only a local invlpg. An
+ * interrupt handler may map on top of the stack as long as it unmaps
+ * before returning. Other CPUs never touch these addresses, so no
+ * shootdown is needed. Only valid once the per-CPU area is set up.
+ */
+static DEF_PER_CPU(uint16_t, kmap_top);
+INIT_PER_CPU(kmap_top) {
+  percpu_write(kmap_top, 0);
+}
+
+/* map 'frame' until the matching kunmap_atomic, in LIFO order */
+void *kmap_atomic(uint64_t frame, uint64_t flags)
+{
+  uint16_t top = percpu_read(kmap_top);
+  uint64_t va;
   uint64_t *pt;
-  uint64_t i = ((uint64_t) va) >> PG_BITS;
 
-  spin_lock(&pg_lock);
+  if (top >= KMAP_SLOTS)
+    panic("out of kmap slots");
+  percpu_write(kmap_top, (uint16_t) (top + 1));
 
+  va = KMAP_BASE + (((uint64_t) get_pcpu_id() * KMAP_SLOTS + top) << PG_BITS);
   pt = get_paging_struct_vaddr((uint64_t *) va, 3);
-  i &= PG_TABLE_MASK;
-  frame = pt[i] & PG_MASK;
-  pt[i] = 0;
-  invalidate_page(va);
+  pt[(va >> PG_BITS) & PG_TABLE_MASK] = frame | flags | PGT_G;
 
-  spin_unlock(&pg_lock);
-  return frame;
+  return (void *) va;
 }
 
-uint64_t vm_unmap_pages(void *va, uint64_t num)
+void kunmap_atomic(void *va)
 {
-  uint64_t frame = 0;
+  uint16_t top = percpu_read(kmap_top);
+  uint64_t slot = ((uint64_t) va - KMAP_BASE) >> PG_BITS;
   uint64_t *pt;
-  uint8_t *pg = (uint8_t *) va;
-  uint64_t i = ((uint64_t) va) >> PG_BITS;
 
-  spin_lock(&pg_lock);
+  if (top == 0 || slot != (uint64_t) get_pcpu_id() * KMAP_SLOTS + top - 1)
+    panic("kunmap_atomic out of order");
 
   pt = get_paging_struct_vaddr((uint64_t *) va, 3);
-  i &= PG_TABLE_MASK;
-  while (num > 0) {
-    if (frame == 0)
-      frame = pt[i] & PG_MASK;
-    pt[i] = 0;
-    invalidate_page(pg);
+  pt[((uint64_t) va >> PG_BITS) & PG_TABLE_MASK] = 0;
+  invalidate_page(va);
 
-    num--;
-    i++;
-    pg += PG_SIZE;
-  }
+  percpu_write(kmap_top, (uint16_t) (top - 1));
+}
+
+/*
+ * also used for pages mapped by vm_map_page_unrestricted, only the
+ * 4KB window and the vmap region have address space to give back
+ */
+uint64_t vm_unmap_pages(void *va, uint64_t num)
+{
+  uint64_t addr = (uint64_t) va;
+  uint64_t frame = vm_clear_range(va, num);
+
+  if (addr >= KERNEL_MAPPING_BASE && addr < KMAP_BASE)
+    slot_free(pg_slots, (addr - KERNEL_MAPPING_BASE) >> PG_BITS, num);
+  else if (addr >= VMAP_BASE && addr < VMAP_LIMIT)
+    vrange_free(&vmap_small, addr);
 
-  spin_unlock(&pg_lock);
   return frame;
 }
 
@@ -195,7 +398,7 @@ void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr)
   uint64_t entry;
   uint64_t *pml4t, *pdpt, *pdt, *pt;
 
-  spin_lock(&pg_lock);
+  qspin_lock(&pg_lock);
 
   pml4t = get_paging_struct_vaddr((uint64_t *) vaddr, 0);
   entry = (vaddr & 0xFF8000000000) >> 39;
@@ -204,6 +407,8 @@ void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr)
     if (new == 0)
       panic("page allocation for PDPT failed");
     pml4t[entry] = new | PGT_P | PGT_RW;
+    /* frames are not zeroed by the allocator */
+    memset(get_paging_struct_vaddr((uint64_t *) vaddr, 1), 0, PG_SIZE);
   }
 
   pdpt = get_paging_struct_vaddr((uint64_t *) vaddr, 1);
@@ -213,6 +418,7 @@ void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr)
     if (new == 0)
       panic("page allocation for PDT failed");
     pdpt[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) vaddr, 2), 0, PG_SIZE);
   }
 
   pdt = get_paging_struct_vaddr((uint64_t *) vaddr, 2);
@@ -222,6 +428,7 @@ void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr)
     if (new == 0)
       panic("page allocation for PT failed");
     pdt[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) vaddr, 3), 0, PG_SIZE);
   }
 
   pt = get_paging_struct_vaddr((uint64_t *) vaddr, 3);
@@ -230,7 +437,7 @@ void vm_map_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vaddr)
     panic("page table entry not available");
   pt[entry] = frame | flags;
 
-  spin_unlock(&pg_lock);
+  qspin_unlock(&pg_lock);
 }
 
 /*
@@ -243,7 +450,7 @@ void vm_map_large_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vad
   uint64_t entry;
   uint64_t *pml4t, *pdpt, *pdt;
 
-  spin_lock(&pg_lock);
+  qspin_lock(&pg_lock);
 
   pml4t = get_paging_struct_vaddr((uint64_t *) vaddr, 0);
   entry = (vaddr & 0xFF8000000000) >> 39;
@@ -252,6 +459,7 @@ void vm_map_large_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vad
     if (new == 0)
       panic("page allocation for PDPT failed");
     pml4t[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) vaddr, 1), 0, PG_SIZE);
   }
 
   pdpt = get_paging_struct_vaddr((uint64_t *) vaddr, 1);
@@ -261,6 +469,7 @@ void vm_map_large_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vad
     if (new == 0)
       panic("page allocation for PDT failed");
     pdpt[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) vaddr, 2), 0, PG_SIZE);
   }
 
   pdt = get_paging_struct_vaddr((uint64_t *) vaddr, 2);
@@ -269,120 +478,54 @@ void vm_map_large_page_unrestricted(uint64_t frame, uint64_t flags, uint64_t vad
     panic("page table entry not available");
   pdt[entry] = frame | flags;
 
-  spin_unlock(&pg_lock);
+  qspin_unlock(&pg_lock);
 }
 
-void *vm_map_large_page(uint64_t frame, uint64_t flags)
+/*
+ * map [0, limit) at DIRECT_MAP_BASE, shared by all CPUs through the
+ * common PML4T; holes of the memory map are covered too, MTRRs keep
+ * their memory type
+ */
+void vm_direct_map_init(uint64_t limit)
 {
-  uint64_t i;
-  void *va;
-  uint64_t *pdt;
-
-  spin_lock(&pg_lock);
-
-  pdt = get_paging_struct_vaddr((uint64_t *) LG_PG_BASE, 2);
-
-  for (i = (LG_PG_BASE >> LARGE_PG_BITS);
-       i < (LG_PG_LIMIT >> LARGE_PG_BITS); i++) {
-    if (!(pdt[i] & PGT_P)) {
-      pdt[i] = frame | flags;
-      va = (void *) (i << LARGE_PG_BITS);
-      spin_unlock(&pg_lock);
-      return va;
-    }
+  uint32_t edx;
+  uint64_t paddr, new, entry, vaddr;
+  uint64_t *pml4t, *pdpt;
+  uint64_t flags = PGT_P | PGT_RW | PGT_XD | PDT_PS | PGT_G;
+
+  if (limit > DIRECT_MAP_SIZE)
+    panic("memory beyond the direct map");
+  direct_map_limit = limit;
+
+  /* 1GB pages: CPUID.80000001H:EDX[26] */
+  cpuid(0x80000001, 0, NULL, NULL, NULL, &edx);
+  if (!(edx & (1 << 26))) {
+    for (paddr = 0; paddr < limit; paddr += LARGE_PG_SIZE)
+      vm_map_large_page_unrestricted(paddr, flags, DIRECT_MAP_BASE + paddr);
+    return;
   }
 
-  spin_unlock(&pg_lock);
-  return NULL;
-}
-
-uint64_t vm_unmap_large_page(void *va)
-{
-  uint64_t frame;
-  uint64_t *pdt;
-  uint64_t i = ((uint64_t) va) >> LARGE_PG_BITS;
-
-  spin_lock(&pg_lock);
-
-  pdt = get_paging_struct_vaddr((uint64_t *) va, 2);
-  i &= PG_TABLE_MASK;
-  frame = pdt[i] & LARGE_PG_MASK;
-  pdt[i] = 0;
-  invalidate_page(va);
-
-  spin_unlock(&pg_lock);
-  return frame;
-}
-
-void *vm_map_large_pages(uint64_t frame, uint64_t num, uint64_t flags)
-{
-  uint64_t i, j;
-  void *va;
-  uint64_t count = 0;
-  uint64_t *pdt;
-
-  if (num < 1) return NULL;
-
-  spin_lock(&pg_lock);
-
-  pdt = get_paging_struct_vaddr((uint64_t *) LG_PG_BASE, 2);
-
-  for (i = (LG_PG_BASE >> LARGE_PG_BITS);
-       i < (LG_PG_LIMIT >> LARGE_PG_BITS) - num + 1; i++) {
-    if (!(pdt[i] & PGT_P)) {
-      count++;
-
-      for (j = i + 1; j < i + num; j++) {
-        if (!(pdt[j] & PGT_P))
-          count++;
-        else
-          break;
-      }
-
-      if (count == num) {
-        for (j = i; j < i + num; j++) {
-          pdt[j] = frame | flags;
-          frame += LARGE_PG_SIZE;
-        }
-
-        va = (void *) (i << LARGE_PG_BITS);
-        spin_unlock(&pg_lock);
-        return va;
-      } else {
-        i = j + 1;
-        count = 0;
-      }
+  qspin_lock(&pg_lock);
+
+  for (paddr = 0; paddr < ceiling64(limit, HUGE_PG_SIZE);
+       paddr += HUGE_PG_SIZE) {
+    vaddr = DIRECT_MAP_BASE + paddr;
+    pml4t = get_paging_struct_vaddr((uint64_t *) vaddr, 0);
+    entry = (vaddr & 0xFF8000000000) >> 39;
+    if ((pml4t[entry] & PGT_P) == 0) {
+      new = alloc_phys_frame();
+      if (new == 0)
+        panic("page allocation for PDPT failed");
+      pml4t[entry] = new | PGT_P | PGT_RW;
+      memset(get_paging_struct_vaddr((uint64_t *) vaddr, 1), 0, PG_SIZE);
     }
-  }
 
-  spin_unlock(&pg_lock);
-  return NULL;
-}
-
-uint64_t vm_unmap_large_pages(void *va, uint64_t num)
-{
-  uint64_t frame = 0;
-  uint64_t *pdt;
-  uint8_t *pg = (uint8_t *) va;
-  uint64_t i = ((uint64_t) va) >> LARGE_PG_BITS;
-
-  spin_lock(&pg_lock);
-
-  pdt = get_paging_struct_vaddr((uint64_t *) va, 2);
-  i &= PG_TABLE_MASK;
-  while (num > 0) {
-    if (frame == 0)
-      frame = pdt[i] & LARGE_PG_MASK;
-    pdt[i] = 0;
-    invalidate_page(pg);
-
-    num--;
-    i++;
-    pg += LARGE_PG_SIZE;
+    pdpt = get_paging_struct_vaddr((uint64_t *) vaddr, 1);
+    entry = (vaddr & 0x7FC0000000) >> 30;
+    pdpt[entry] = paddr | flags;
   }
 
-  spin_unlock(&pg_lock);
-  return frame;
+  qspin_unlock(&pg_lock);
 }
 
 void vm_init(void)
@@ -400,6 +543,7 @@ void vm_init(void)
     if (new == 0)
       panic("page allocation for PDPT failed");
     pml4t[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 1), 0, PG_SIZE);
   }
 
   pdpt = get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 1);
@@ -409,6 +553,7 @@ void vm_init(void)
     if (new == 0)
       panic("page allocation for PDT failed");
     pdpt[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 2), 0, PG_SIZE);
   }
 
   pdt = get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 2);
@@ -418,14 +563,25 @@ void vm_init(void)
     if (new == 0)
       panic("page allocation for PT failed");
     pdt[entry] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 3), 0, PG_SIZE);
   }
 
   pt = get_paging_struct_vaddr((uint64_t *) KERNEL_MAPPING_BASE, 3);
   for (i = 0; i < PG_TABLE_ENTRIES; i++)
     pt[i] = 0;
 
-  /* initialize large page mapping entries */
-  for (i = (LG_PG_BASE >> LARGE_PG_BITS);
-       i < (LG_PG_LIMIT >> LARGE_PG_BITS); i++)
-    pdt[i] = 0;
+  vrange_init(&vmap_small, VMAP_BASE, VMAP_LIMIT, PG_SIZE);
+
+  /* page tables of the kmap slots, within the same PDT */
+  if (KMAP_LIMIT > HUGE_PG_SIZE)
+    panic("too many kmap slots");
+  for (i = (KMAP_BASE >> LARGE_PG_BITS);
+       i < ((KMAP_LIMIT + LARGE_PG_SIZE - 1) >> LARGE_PG_BITS); i++) {
+    new = alloc_phys_frame();
+    if (new == 0)
+      panic("page allocation for kmap PT failed");
+    pdt[i] = new | PGT_P | PGT_RW;
+    memset(get_paging_struct_vaddr((uint64_t *) ((uint64_t) i
+                                   << LARGE_PG_BITS), 3), 0, PG_SIZE);
+  }
 }
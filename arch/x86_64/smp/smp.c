@@ -23,7 +23,10 @@
 #include "percpu.h"
 #include "cpu.h"
 #include "utils/spinlock.h"
+#include "utils/qspinlock.h"
 #include "interrupt.h"
+#include "numa.h"
+#include "tlb.h"
 
 extern uint8_t status_code[], ap_stack_ptr[];
 extern uint8_t ap_boot_start[];
@@ -49,7 +52,7 @@ bool smp_boot_cpu(uint8_t lapic)
   uint64_t cnt;
   uint8_t *va;
   
-  stack = alloc_phys_frame();
+  stack = alloc_phys_frame_node(numa_node_of_apic(lapic));
   if (stack == 0)
     panic("running out of memory");
   va = (uint8_t *) vm_map_page(stack, PGT_P | PGT_RW | PGT_XD);
@@ -93,6 +96,7 @@ void ap_main(void)
 
   /* needs synchronization, so before setting boot status */
   percpu_init();
+  mmu_tlb_init();
 
   BOOT_STATUS() = 1;
 
@@ -120,10 +124,18 @@ void ap_main(void)
   spin_unlock(&mtrr_lock);
   while (mtrr_sync != 0) ;
 
-  while (!virt_start) ;
+#ifdef LOCK_BENCH
+  lock_bench();
+#endif
+
+  /* zero frames for VM setup while waiting */
+  while (!virt_start)
+    physical_zero_refill();
   //virt_percpu_init();
 
   interrupt_enable();
+  tlb_cpu_enter();
 
-  while(1);
+  while(1)
+    physical_zero_refill();
 }
@@ -0,0 +1,305 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virt/virt_internal.h"
+#include "vm.h"
+#include "debug.h"
+#include "mm/physical.h"
+#include "mm/kmem.h"
+#include "utils/screen.h"
+#include "asm_string.h"
+
+
+static const char *mem_type_names[VM_MEM_TYPES] = {"RAM", "EPT", "VMX"};
+static kmem_cache_t *mem_blk_cache = NULL;
+
+/*
+ * per-VM ownership of physical frames: every frame given to a VM is
+ * charged against its quota and recorded, so that the VM can be torn
+ * down by releasing what it owns
+ */
+void virt_mem_init(vm_struct_t *vm)
+{
+  uint8_t i;
+
+  if (mem_blk_cache == NULL) {
+    mem_blk_cache = kmem_cache_create(sizeof(vm_mem_blk_t), 8);
+    if (mem_blk_cache == NULL)
+      panic("Failed to create the VM memory record cache");
+  }
+
+  for (i = 0; i < VM_MEM_TYPES; i++) {
+    vm->mem_used[i] = 0;
+    vm->mem_quota[i] = 0;
+  }
+  vm->mem_quota[VM_MEM_RAM] = (uint64_t) VIRT_RAM_QUOTA << (20 - PG_BITS);
+  vm->mem_quota[VM_MEM_EPT] = VIRT_EPT_QUOTA;
+  vm->mem_recs = NULL;
+}
+
+/* account 'frames' of 'type' to 'vm', false if over quota, lock held */
+static bool virt_mem_charge(vm_struct_t *vm, uint8_t type, uint64_t frames)
+{
+  uint64_t quota = vm->mem_quota[type];
+
+  if (quota && vm->mem_used[type] + frames > quota)
+    return false;
+
+  vm->mem_used[type] += frames;
+  return true;
+}
+
+/*
+ * record a range owned by 'vm', merged into the last one if adjacent
+ * and released the same way: huge frames keep their size as the unit,
+ * so runs of them and of single colored frames take one record
+ */
+static void virt_mem_record(vm_struct_t *vm, uint64_t paddr, uint64_t frames,
+                            uint8_t type, uint8_t src)
+{
+  vm_mem_blk_t *blk;
+  vm_mem_rec_t *rec;
+  uint32_t unit = src == VM_SRC_HUGE ? frames : 1;
+
+  spin_lock(&vm->lock);
+
+  blk = vm->mem_recs;
+  if (blk && blk->count) {
+    rec = &blk->recs[blk->count - 1];
+    if (rec->src == src && rec->type == type && rec->unit == unit
+        && rec->paddr + (rec->frames << PG_BITS) == paddr) {
+      rec->frames += frames;
+      spin_unlock(&vm->lock);
+      return;
+    }
+  }
+
+  if (blk == NULL || blk->count == VM_MEM_RECS) {
+    blk = (vm_mem_blk_t *) kmem_cache_alloc(mem_blk_cache);
+    if (blk == NULL)
+      panic("Failed to allocate VM memory records");
+    blk->count = 0;
+    blk->next = vm->mem_recs;
+    vm->mem_recs = blk;
+  }
+
+  rec = &blk->recs[blk->count++];
+  rec->paddr = paddr;
+  rec->frames = frames;
+  rec->type = type;
+  rec->src = src;
+  rec->unit = unit;
+
+  spin_unlock(&vm->lock);
+}
+
+static bool virt_mem_reserve(vm_struct_t *vm, uint8_t type, uint64_t frames)
+{
+  bool ret;
+
+  spin_lock(&vm->lock);
+  ret = virt_mem_charge(vm, type, frames);
+  spin_unlock(&vm->lock);
+
+  if (!ret)
+    printf("VM %u: %s quota of %llu frames exceeded\n", vm->vm_id,
+           mem_type_names[type], vm->mem_quota[type]);
+  return ret;
+}
+
+/* give back a charge whose allocation failed */
+static void virt_mem_unreserve(vm_struct_t *vm, uint8_t type, uint64_t frames)
+{
+  spin_lock(&vm->lock);
+  vm->mem_used[type] -= frames;
+  spin_unlock(&vm->lock);
+}
+
+/*
+ * contiguous frames on the node of 'vm', aligned to 'align' bytes,
+ * return 0 if over quota or out of memory
+ */
+uint64_t virt_alloc_frames(vm_struct_t *vm, uint8_t type, uint64_t num,
+                           uint64_t align)
+{
+  uint64_t paddr;
+
+  if (!virt_mem_reserve(vm, type, num))
+    return 0;
+
+  paddr = alloc_phys_frames_aligned_node(num, align, vm->node);
+  if (paddr == 0) {
+    virt_mem_unreserve(vm, type, num);
+    return 0;
+  }
+
+  virt_mem_record(vm, paddr, num, type, VM_SRC_FRAMES);
+  return paddr;
+}
+
+/* RAM frame below 1MB, 0 if fail */
+uint64_t virt_alloc_lowmem_frame(vm_struct_t *vm)
+{
+  uint64_t paddr;
+
+  if (!virt_mem_reserve(vm, VM_MEM_RAM, 1))
+    return 0;
+
+  paddr = alloc_phys_frame_lowmem();
+  if (paddr == 0) {
+    virt_mem_unreserve(vm, VM_MEM_RAM, 1);
+    return 0;
+  }
+
+  virt_mem_record(vm, paddr, 1, VM_MEM_RAM, VM_SRC_FRAMES);
+  return paddr;
+}
+
+/* zeroed frame on 'node' for EPT or VMX structures, 0 if fail */
+uint64_t virt_alloc_zeroed_frame(vm_struct_t *vm, uint8_t type, uint8_t node)
+{
+  uint64_t paddr;
+
+  if (!virt_mem_reserve(vm, type, 1))
+    return 0;
+
+  paddr = alloc_zeroed_phys_frame_node(node);
+  if (paddr == 0) {
+    virt_mem_unreserve(vm, type, 1);
+    return 0;
+  }
+
+  virt_mem_record(vm, paddr, 1, type, VM_SRC_FRAMES);
+  return paddr;
+}
+
+/*
+ * zeroed 2MB / 1GB RAM frame from the reserved pools, 0 if fail;
+ * the pools are not kept zeroed, clear it through the direct map
+ * before the guest can see it
+ */
+uint64_t virt_alloc_huge_frame(vm_struct_t *vm, uint64_t size)
+{
+  uint64_t frames = size >> PG_BITS;
+  uint64_t paddr;
+
+  if (!virt_mem_reserve(vm, VM_MEM_RAM, frames))
+    return 0;
+
+  paddr = alloc_phys_huge_frame(size);
+  if (paddr == 0) {
+    virt_mem_unreserve(vm, VM_MEM_RAM, frames);
+    return 0;
+  }
+  memset(phys_to_virt(paddr), 0, size);
+
+  virt_mem_record(vm, paddr, frames, VM_MEM_RAM, VM_SRC_HUGE);
+  return paddr;
+}
+
+/* zeroed RAM frame in the LLC colors of 'vm', 0 if fail */
+uint64_t virt_alloc_color_frame(vm_struct_t *vm)
+{
+  uint64_t paddr;
+
+  if (!virt_mem_reserve(vm, VM_MEM_RAM, 1))
+    return 0;
+
+  paddr = alloc_phys_frame_color(vm->color_mask);
+  if (paddr == 0) {
+    virt_mem_unreserve(vm, VM_MEM_RAM, 1);
+    return 0;
+  }
+  memset(phys_to_virt(paddr), 0, PG_SIZE);
+
+  virt_mem_record(vm, paddr, 1, VM_MEM_RAM, VM_SRC_COLOR);
+  return paddr;
+}
+
+/* take the free range [begin, begin + length) as RAM of 'vm' */
+bool virt_take_range(vm_struct_t *vm, uint64_t begin, uint64_t length)
+{
+  uint64_t frames = length >> PG_BITS;
+
+  if (!virt_mem_reserve(vm, VM_MEM_RAM, frames))
+    return false;
+
+  physical_take_range(begin, length);
+  virt_mem_record(vm, begin, frames, VM_MEM_RAM, VM_SRC_FRAMES);
+  return true;
+}
+
+/* frames of 'type' 'vm' can still be charged, MM_NONE without a quota */
+uint64_t virt_mem_left(vm_struct_t *vm, uint8_t type)
+{
+  uint64_t left = MM_NONE;
+
+  spin_lock(&vm->lock);
+  if (vm->mem_quota[type])
+    left = vm->mem_quota[type] - vm->mem_used[type];
+  spin_unlock(&vm->lock);
+
+  return left;
+}
+
+/* give every frame owned by 'vm' back, the VM must not run anymore */
+void virt_vm_release(vm_struct_t *vm)
+{
+  vm_mem_blk_t *blk, *next;
+  vm_mem_rec_t *rec;
+  uint64_t j;
+  uint32_t i;
+
+  spin_lock(&vm->lock);
+  blk = vm->mem_recs;
+  vm->mem_recs = NULL;
+  for (i = 0; i < VM_MEM_TYPES; i++)
+    vm->mem_used[i] = 0;
+  spin_unlock(&vm->lock);
+
+  for ( ; blk; blk = next) {
+    for (i = 0; i < blk->count; i++) {
+      rec = &blk->recs[i];
+      if (rec->src == VM_SRC_HUGE) {
+        for (j = 0; j < rec->frames; j += rec->unit)
+          free_phys_huge_frame(rec->paddr + (j << PG_BITS),
+                               (uint64_t) rec->unit << PG_BITS);
+      } else if (rec->src == VM_SRC_COLOR) {
+        for (j = 0; j < rec->frames; j++)
+          free_phys_frame_color(rec->paddr + (j << PG_BITS));
+      } else
+        free_phys_frames(rec->paddr, rec->frames);
+    }
+    next = blk->next;
+    kmem_cache_free(mem_blk_cache, blk);
+  }
+}
+
+void virt_mem_dump(vm_struct_t *vm)
+{
+  uint8_t i;
+
+  printf("VM %u memory (frames):", vm->vm_id);
+  for (i = 0; i < VM_MEM_TYPES; i++) {
+    if (vm->mem_quota[i])
+      printf(" %s %llu/%llu", mem_type_names[i], vm->mem_used[i],
+             vm->mem_quota[i]);
+    else
+      printf(" %s %llu", mem_type_names[i], vm->mem_used[i]);
+  }
+  printf("\n");
+}
@@ -23,13 +23,24 @@
 #include "utils/screen.h"
 #include "virt/linux.h"
 #include "utils/math.h"
+#include "utils/bits.h"
+#include "msr.h"
 
 
+/* guest RAM of 'vm' is restricted to part of the LLC */
+static inline bool virt_vm_colored(vm_struct_t *vm)
+{
+  return vm->color_mask != phys_all_colors();
+}
+
 /*
  * most memory regions are identity-mapped with large pages;
- * kernel is not identity-mapped and is mapped with 4KB pages
+ * kernel is not identity-mapped and is mapped with 4KB pages;
+ * only the identity-mapped ranges below the kernel are taken here,
+ * RAM above it is backed by frames virt_pg_table_setup allocates
  */
-static void virt_setup_e820(boot_params_t *zero_page, uint64_t kernel_size)
+static void virt_setup_e820(vm_struct_t *vm, boot_params_t *zero_page,
+                            uint64_t kernel_size)
 {
   uint64_t mmap_start = 0, mmap_size = 0;
   uint8_t mmap_num = 0;
@@ -39,6 +50,7 @@ static void virt_setup_e820(boot_params_t *zero_page, uint64_t kernel_size)
   uint64_t ramdisk_end = zero_page->hdr.ramdisk_image
                          + zero_page->hdr.ramdisk_size;
   uint64_t kernel_end = LINUX_ENTRY_POINT + kernel_size;
+  uint64_t owned, left, promised = 0;
 
   while (true) {
     start_paddr = mmap_start + mmap_size;
@@ -58,6 +70,9 @@ static void virt_setup_e820(boot_params_t *zero_page, uint64_t kernel_size)
     if (mmap_size == 0)
       break;
 
+    /* head of the range already owned by the VM */
+    owned = 0;
+
     if (mmap_start >= kernel_end) {
       uint64_t old_addr, tmp;
 
@@ -85,18 +100,36 @@ static void virt_setup_e820(boot_params_t *zero_page, uint64_t kernel_size)
          * add zero_frame and cmd_frame (from
          * virt_setup_linux) to linux memory
          */
-        mmap_start -= 2 << PG_BITS;
-        mmap_size += 2 << PG_BITS;
+        owned = 2 << PG_BITS;
+        mmap_start -= owned;
+        mmap_size += owned;
       }
     }
 
+    /*
+     * mark unavailable to hypervisor, ranges over the RAM quota are
+     * left out; above the kernel the range stays free and only what
+     * the quota can still back is listed
+     */
+    if (mmap_start < kernel_end) {
+      if (!virt_take_range(vm, mmap_start + owned, mmap_size - owned))
+        continue;
+    } else {
+      left = virt_mem_left(vm, VM_MEM_RAM);
+      if (left != MM_NONE) {
+        left = left > promised ? (left - promised) << PG_BITS : 0;
+        if (mmap_size > left)
+          mmap_size = left & LARGE_PG_MASK;
+        if (mmap_size == 0)
+          continue;
+      }
+      promised += mmap_size >> PG_BITS;
+    }
+
     table[mmap_num].addr = mmap_start;
     table[mmap_num].size = mmap_size;
     table[mmap_num].type = E820_RAM;
     mmap_num++;
-
-    /* mark unavailable to hypervisor */
-    physical_take_range(mmap_start, mmap_size);
     printf("mmap: %llX, %llX\n", mmap_start, mmap_size);
   }
 
@@ -110,31 +143,26 @@ static void virt_setup_linux(vm_struct_t *vm)
   uint64_t *gdt;
   boot_params_t *zero_virt;
   setup_header_t *setup;
-  uint64_t start_paddr, frame;
+  uint64_t start_paddr;
   uint8_t *src_vaddr, *dst_vaddr;
   uint64_t kernel_size;
-  uint8_t src_pages, dst_pages;
+  uint8_t dst_pages;
 
   /* initialize zeropage below 1MB for identity mapping */
-  zero_frame = alloc_phys_frame_lowmem();
+  zero_frame = virt_alloc_lowmem_frame(vm);
   if (zero_frame == 0)
     panic("page allocation for zero_frame failed");
-  zero_virt = (boot_params_t *) vm_map_page(zero_frame, PGT_P | PGT_RW);
-  if (zero_virt == NULL)
-    panic("page mapping for zero_frame failed");
+  zero_virt = (boot_params_t *) phys_to_virt(zero_frame);
   memset(zero_virt, 0, PG_SIZE);
 
   /* load linux setup header */
   if (vm->img_paddr & (~PG_MASK))
     panic("Image address not aligned to 4KB");
-  linux_virt = (uint8_t *) vm_map_page(vm->img_paddr, PGT_P | PGT_RW);
-  if (linux_virt == NULL)
-    panic("page mapping for header failed");
+  linux_virt = (uint8_t *) phys_to_virt(vm->img_paddr);
   setup = (setup_header_t *) (linux_virt + LINUX_HEADER_OFFSET);
   if (setup->header != LINUX_HEADER_MAGIC)
     panic("Image magic number does not match");
   memcpy(&(zero_virt->hdr), setup, sizeof(setup_header_t));
-  vm_unmap_page(linux_virt);
 
   /*
    * relocate kernel to make sure it's 4KB page-aligned
@@ -142,37 +170,23 @@ static void virt_setup_linux(vm_struct_t *vm)
    */
   start_paddr = vm->img_paddr + (zero_virt->hdr.setup_sects + 1)
                 * LINUX_SECTOR_SZ;
-  frame = start_paddr & LARGE_PG_MASK;
   kernel_size = vm->img_size - (zero_virt->hdr.setup_sects + 1)
                 * LINUX_SECTOR_SZ;
-  src_pages = ceiling64(start_paddr - frame + kernel_size, LARGE_PG_SIZE)
-              >> LARGE_PG_BITS;
-  src_vaddr = (uint8_t *) vm_map_large_pages(frame, src_pages, PGT_P | PDT_PS);
-  if (src_vaddr == NULL)
-    panic("page mapping for src kernel failed");
-  src_vaddr += start_paddr - frame;
+  src_vaddr = (uint8_t *) phys_to_virt(start_paddr);
 
   dst_pages = ceiling64(kernel_size, LARGE_PG_SIZE) >> LARGE_PG_BITS;
-  new_frames = alloc_phys_frames_aligned(dst_pages << (LARGE_PG_BITS - PG_BITS),
-                                         LARGE_PG_SIZE);
+  new_frames = virt_alloc_frames(vm, VM_MEM_RAM,
+                                 dst_pages << (LARGE_PG_BITS - PG_BITS),
+                                 LARGE_PG_SIZE);
   if (new_frames == 0)
     panic("page allocation for dst kernel failed");
-  dst_vaddr = (uint8_t *) vm_map_large_pages(new_frames, dst_pages,
-                                             PGT_P | PGT_RW | PDT_PS);
-  if (dst_vaddr == NULL)
-    panic("page mapping for dst kernel failed");
-
-  //TODO: why no need for RW?
-  vm_check_mapping(dst_vaddr);
+  dst_vaddr = (uint8_t *) phys_to_virt(new_frames);
 
   memcpy(dst_vaddr, src_vaddr, kernel_size);
 
   /* free the original kernel */
-  vm_unmap_large_pages(src_vaddr - (start_paddr - frame), src_pages);
   physical_free_range(vm->img_paddr, vm->img_size);
 
-  vm_unmap_large_pages(dst_vaddr, dst_pages);
-
   vm->img_paddr = new_frames;
   vm->img_size = kernel_size;
 
@@ -180,8 +194,10 @@ static void virt_setup_linux(vm_struct_t *vm)
    * first half page is for gdt, second half is for
    * linux boot argument, identity mapping
    */
-  cmd_frame = alloc_phys_frame_lowmem();
-  gdt = (uint64_t *) vm_map_page(cmd_frame, PGT_P | PGT_RW);
+  cmd_frame = virt_alloc_lowmem_frame(vm);
+  if (cmd_frame == 0)
+    panic("page allocation for cmd_frame failed");
+  gdt = (uint64_t *) phys_to_virt(cmd_frame);
   cmd_virt = (uint8_t *) gdt;
   gdt[0] = 0;
   gdt[1] = 0;
@@ -192,7 +208,6 @@ static void virt_setup_linux(vm_struct_t *vm)
   //TODO move cmdline arguments to grub.cfg
   cmd_virt += PG_SIZE >> 1;
   memcpy(cmd_virt, LINUX_CMD_LINE, sizeof(LINUX_CMD_LINE));
-  vm_unmap_page(gdt);
   zero_virt->hdr.cmd_line_ptr = cmd_frame + (PG_SIZE >> 1);
 
   zero_virt->hdr.type_of_loader = 0xFF;
@@ -201,27 +216,19 @@ static void virt_setup_linux(vm_struct_t *vm)
   zero_virt->hdr.code32_start = vm->entry_point;
 
   /* relocate ramdisk to make large page alignment */
-  frame = vm->extra_paddr & LARGE_PG_MASK;
-  src_pages = ceiling64(vm->extra_size + vm->extra_paddr - frame,
-                        LARGE_PG_SIZE) >> LARGE_PG_BITS;
-  src_vaddr = (uint8_t *) vm_map_large_pages(frame, src_pages, PGT_P | PDT_PS);
-  if (src_vaddr == NULL)
-    panic("page mapping for src ramdisk failed");
-  src_vaddr += vm->extra_paddr - frame;
+  src_vaddr = (uint8_t *) phys_to_virt(vm->extra_paddr);
 
   dst_pages = ceiling64(vm->extra_size, LARGE_PG_SIZE) >> LARGE_PG_BITS;
-  new_frames = alloc_phys_frames_aligned(dst_pages << (LARGE_PG_BITS - PG_BITS),
-                                         LARGE_PG_SIZE);
+  new_frames = virt_alloc_frames(vm, VM_MEM_RAM,
+                                 dst_pages << (LARGE_PG_BITS - PG_BITS),
+                                 LARGE_PG_SIZE);
   if (new_frames == 0)
     panic("page allocation for dst ramdisk failed");
-  dst_vaddr = (uint8_t *) vm_map_large_pages(new_frames, dst_pages, PGT_P | PGT_RW | PDT_PS);
-  if (dst_vaddr == NULL)
-    panic("page mapping for dst ramdisk failed");
+  dst_vaddr = (uint8_t *) phys_to_virt(new_frames);
 
   memcpy(dst_vaddr, src_vaddr, vm->extra_size);
 
   /* free the original ramdisk */
-  vm_unmap_large_pages(src_vaddr - (vm->extra_paddr - frame), src_pages);
   physical_free_range(vm->extra_paddr, vm->extra_size);
 
   vm->extra_paddr = new_frames;
@@ -230,19 +237,66 @@ static void virt_setup_linux(vm_struct_t *vm)
   zero_virt->hdr.ramdisk_image = vm->extra_paddr;
   zero_virt->hdr.ramdisk_size = vm->extra_size;
 
-  virt_setup_e820(zero_virt, kernel_size);
+  virt_setup_e820(vm, zero_virt, kernel_size);
 
-  vm_unmap_page(zero_virt);
   vm->input = zero_frame;
 }
 
+/* zeroed EPT table on the node of 'vm', through the direct map */
+static uint64_t *virt_ept_table(vm_struct_t *vm)
+{
+  uint64_t frame = virt_alloc_zeroed_frame(vm, VM_MEM_EPT, vm->node);
+
+  if (frame == 0)
+    panic("Failed to allocate an EPT table frame");
+
+  return (uint64_t *) phys_to_virt(frame);
+}
+
+/*
+ * returns a PT mapping 2MB of guest RAM with 4KB frames
+ * in the LLC colors of 'vm'
+ */
+static uint64_t *virt_color_pt(vm_struct_t *vm)
+{
+  uint64_t ram;
+  uint64_t *pt_virt = virt_ept_table(vm);
+  uint16_t k;
+
+  for (k = 0; k < PG_TABLE_ENTRIES; k++) {
+    ram = virt_alloc_color_frame(vm);
+    if (ram == 0)
+      panic("Out of frames in the VM's page colors");
+    pt_virt[k] = ram | EPT_RD | EPT_WR | EPT_EX | EPT_TP(EPT_TYPE_WB);
+  }
+
+  return pt_virt;
+}
+
+/*
+ * zeroed 2MB of guest RAM owned by 'vm': a reserved frame, or else
+ * aligned frames from the allocator, 0 if over quota or out of memory
+ */
+static uint64_t virt_guest_ram(vm_struct_t *vm)
+{
+  uint64_t ram = virt_alloc_huge_frame(vm, LARGE_PG_SIZE);
+
+  if (ram)
+    return ram;
+
+  ram = virt_alloc_frames(vm, VM_MEM_RAM, LARGE_PG_SIZE >> PG_BITS,
+                          LARGE_PG_SIZE);
+  if (ram)
+    memset(phys_to_virt(ram), 0, LARGE_PG_SIZE);
+  return ram;
+}
+
 /*
  * TODO: rewrite this
  * returns the physical address of the EPT base
  */
 uint64_t virt_pg_table_setup(vm_struct_t *vm)
 {
-  uint64_t pml4t_phy, pdpt_phy;
   uint64_t *pml4t_virt, *pdpt_virt;
   uint32_t pdt_entries = vm->ram_size >> 1;
   uint32_t pdpt_entries = (pdt_entries + (PG_TABLE_ENTRIES - 1)) >> PG_TABLE_BITS;
@@ -251,41 +305,45 @@ uint64_t virt_pg_table_setup(vm_struct_t *vm)
   //TODO fix this, start from img_paddr
   uint64_t kernel_phy = vm->img_paddr + 0x100000;
   uint64_t ramdisk_phy = vm->extra_paddr;
+  uint64_t low_ram;
+  /* EPT supports 1GB pages */
+  bool ept_1g = get_bit64(rdmsr(IA32_VMX_EPT_VPID_CAP), 17);
 
-  pml4t_phy = alloc_phys_frame();
-  if (pml4t_phy == 0)
-    panic("Failed to allocate a PML4T frame");
-  pml4t_virt = (uint64_t *) vm_map_page(pml4t_phy, PGT_P | PGT_RW);
-  if (pml4t_virt == NULL)
-    panic("Failed to map PML4T");
-
-  pdpt_phy = alloc_phys_frame();
-  if (pdpt_phy == 0)
-    panic("Failed to allocate a PDPT frame");
-  pdpt_virt = (uint64_t *) vm_map_page(pdpt_phy, PGT_P | PGT_RW);
-  if (pdpt_virt == NULL)
-    panic("Failed to map PDPT");
-
-  memset(pml4t_virt, 0, PG_SIZE);
-  memset(pdpt_virt, 0, PG_SIZE);
+  pml4t_virt = virt_ept_table(vm);
+  pdpt_virt = virt_ept_table(vm);
 
   /* max memory size supported: 512GB */
-  pml4t_virt[0] = pdpt_phy | EPT_RD | EPT_WR | EPT_EX;
+  pml4t_virt[0] = vm_virt_to_phys(pdpt_virt) | EPT_RD | EPT_WR | EPT_EX;
+
+  /* second MB of guest RAM, holds the 32-bit test code */
+  low_ram = virt_alloc_frames(vm, VM_MEM_RAM, PG_TABLE_ENTRIES / 2, PG_SIZE);
+  if (low_ram == 0)
+    panic("Failed to allocate the second MB of guest RAM");
+  memset(phys_to_virt(low_ram), 0, LARGE_PG_SIZE / 2);
 
   virt_setup_linux(vm);
 
   for (i = 0; i < pdpt_entries; i++) {
     uint64_t *pdt_virt;
-    uint64_t frame;
-
-    frame = alloc_phys_frame();
-    if (frame == 0)
-      panic("Failed to allocate a PDT frame");
-    pdpt_virt[i] = frame | EPT_RD | EPT_WR | EPT_EX;
+    uint64_t ram;
+
+    /* a whole GB of plain guest RAM, back it with a reserved 1GB frame */
+    if (ept_1g && i > 0 && !virt_vm_colored(vm)
+        && count + PG_TABLE_ENTRIES * PG_TABLE_ENTRIES <= bound
+        && kernel_phy >= (vm->img_size + vm->img_paddr)
+        && ramdisk_phy >= (vm->extra_size + vm->extra_paddr)) {
+      ram = virt_alloc_huge_frame(vm, HUGE_PG_SIZE);
+      if (ram) {
+        pdpt_virt[i] = ram | EPT_RD | EPT_WR | EPT_EX | EPT_PG
+                       | EPT_TP(EPT_TYPE_WB);
+        count += PG_TABLE_ENTRIES * PG_TABLE_ENTRIES;
+        if (count >= bound) break;
+        continue;
+      }
+    }
 
-    pdt_virt = (uint64_t *) vm_map_page(frame, PGT_P | PGT_RW);
-    if (pdt_virt == NULL)
-      panic("Failed to map PDT");
+    pdt_virt = virt_ept_table(vm);
+    pdpt_virt[i] = vm_virt_to_phys(pdt_virt) | EPT_RD | EPT_WR | EPT_EX;
 
     for (j = 0; j < PG_TABLE_ENTRIES; j++) {
       uint64_t frame_offset = PG_SIZE * PG_TABLE_ENTRIES * PG_TABLE_ENTRIES * i
@@ -294,15 +352,9 @@ uint64_t virt_pg_table_setup(vm_struct_t *vm)
       /* first 2MB */
       if (i == 0 && j == 0) {
         uint16_t k;
-        uint64_t *pt_virt;
-        uint64_t pt_frame = alloc_phys_frame();
-        if (pt_frame == 0)
-          panic("Failed to allocate a PT frame");
-        pdt_virt[j] = pt_frame | EPT_RD | EPT_WR | EPT_EX;
+        uint64_t *pt_virt = virt_ept_table(vm);
 
-        pt_virt = (uint64_t *) vm_map_page(pt_frame, PGT_P | PGT_RW);
-        if (pt_virt == NULL)
-          panic("Failed to map PT");
+        pdt_virt[j] = vm_virt_to_phys(pt_virt) | EPT_RD | EPT_WR | EPT_EX;
 
         frame_offset -= PG_SIZE;
         for (k = 0; k < PG_TABLE_ENTRIES; k++) {
@@ -314,13 +366,13 @@ uint64_t virt_pg_table_setup(vm_struct_t *vm)
             pt_virt[k] = frame_offset | EPT_RD | EPT_WR | EPT_EX
                          | EPT_TP(EPT_TYPE_WB);
           else
-            pt_virt[k] = (frame_offset + 0x100000000) | EPT_RD
-                         | EPT_WR | EPT_EX | EPT_TP(EPT_TYPE_WB);
+            pt_virt[k] = (low_ram + ((k - PG_TABLE_ENTRIES / 2) << PG_BITS))
+                         | EPT_RD | EPT_WR | EPT_EX | EPT_TP(EPT_TYPE_WB);
 
           //TODO: 32-bit test starts at 1MB
           if (k == PG_TABLE_ENTRIES / 2) {
-            uint16_t *test_addr = (uint16_t *) vm_map_page(frame_offset
-                                  + 0x100000000, PGT_P | PGT_RW);
+            uint16_t *test_addr = (uint16_t *) kmap_atomic(low_ram,
+                                                           PGT_P | PGT_RW);
 
             //print OK: movl imm32, 0xB8000
             test_addr[0] = 0x05c7;
@@ -330,11 +382,9 @@ uint64_t virt_pg_table_setup(vm_struct_t *vm)
             test_addr[4] = 0x2f4b;//(green)K
             test_addr[5] = 0xf4f4;//hlt
 
-            vm_unmap_page(test_addr);
+            kunmap_atomic(test_addr);
           }
         }
-
-        vm_unmap_page(pt_virt);
       } else if (kernel_phy < (vm->img_size + vm->img_paddr)) {
         /* map kernel */
         pdt_virt[j] = kernel_phy | EPT_RD | EPT_WR | EPT_EX | EPT_PG
@@ -345,20 +395,27 @@ uint64_t virt_pg_table_setup(vm_struct_t *vm)
         pdt_virt[j] = ramdisk_phy | EPT_RD | EPT_WR | EPT_EX | EPT_PG
                       | EPT_TP(EPT_TYPE_WB);
         ramdisk_phy += LARGE_PG_SIZE;
+      } else if (virt_vm_colored(vm)) {
+        pdt_virt[j] = vm_virt_to_phys(virt_color_pt(vm))
+                      | EPT_RD | EPT_WR | EPT_EX;
       } else {
-        pdt_virt[j] = (frame_offset + 0x100000000) | EPT_RD | EPT_WR
-                      | EPT_EX | EPT_PG | EPT_TP(EPT_TYPE_WB);
+        ram = virt_guest_ram(vm);
+        if (ram == 0) {
+          /* over the RAM quota or out of memory, guest RAM ends here */
+          printf("VM %u: guest RAM ends at %llu MB\n", vm->vm_id,
+                 frame_offset >> 20);
+          bound = count;
+          break;
+        }
+        pdt_virt[j] = ram | EPT_RD | EPT_WR | EPT_EX | EPT_PG
+                      | EPT_TP(EPT_TYPE_WB);
       }
 
       count += PG_TABLE_ENTRIES;
       if (count >= bound) break;
     }
-
-    vm_unmap_page(pdt_virt);
+    if (count >= bound) break;
   }
 
-  vm_unmap_page(pml4t_virt);
-  vm_unmap_page(pdpt_virt);
-
-  return pml4t_phy;
+  return vm_virt_to_phys(pml4t_virt);
 }
@@ -28,12 +28,16 @@
 #include "utils/screen.h"
 #include "utils/bits.h"
 #include "mm/physical.h"
+#include "numa.h"
 #include "virt/linux.h"
+#include "tlb.h"
+#include "interrupt.h"
 
 //#define VIRT_DEBUG
 
 vm_struct_t *vm_structs;
 uint16_t cpu_to_vm[MAX_CPUS];
+rwlock_t vm_table_lock = RWLOCK_UNLOCKED_WRITER_PREF;
 
 static uint64_t vmxon_region[MAX_CPUS];
 static uint64_t vmcs_mem_type = 0;
@@ -79,12 +83,54 @@ uint16_t virt_diagnose(void)
   return basic;
 }
 
+/*
+ * VM entry failed on this CPU and the guest never ran: drop the VMCS
+ * and leave VMX operation, the last vCPU of the VM to stop gives all
+ * its frames back
+ */
+static void virt_vcpu_stop(void)
+{
+  uint16_t cpu = get_pcpu_id();
+  vm_struct_t *vm;
+  uint16_t left;
+
+  vmclear(vmptrst());
+  vmxoff();
+  vmxon_region[cpu] = 0;
+
+  write_lock(&vm_table_lock);
+  vm = virt_cpu_to_vm(cpu);
+  cpu_to_vm[cpu] = VM_NONE;
+  spin_lock(&vm->lock);
+  left = --vm->num_cpus;
+  spin_unlock(&vm->lock);
+  write_unlock(&vm_table_lock);
+
+  /* no CPU maps to the VM anymore, the last one out owns it */
+  if (left == 0) {
+    virt_vm_release(vm);
+    printf("VM %u stopped, memory released\n", vm->vm_id);
+  }
+}
+
 static void virt_main(void)
 {
   uint64_t flags;
+
+  /* VM exit clears IF, the exit path runs with interrupts off */
+  tlb_cpu_enter();
+  if (get_bit64(vmread(VMCS_EXIT_REASON), 31)) {
+    virt_diagnose();
+    virt_vcpu_stop();
+    /* idle for good, TLB_VECTOR is the only interrupt left to take */
+    interrupt_enable();
+    while (1)
+      halt();
+  }
   virt_diagnose();
   panic("virt_main");
 
+  tlb_cpu_leave();
   __asm__ volatile("vmresume" : : : "cc", "memory");
 
   virt_check_error(flags);
@@ -355,8 +401,30 @@ static void virt_control_setup(uint64_t ept_p)
 #endif
 }
 
+#ifdef VIRT_PAGE_COLORING
+/*
+ * LLC page colors of VM 'idx' out of 'nr': the colors are split
+ * evenly, VMs share colors only when there are more VMs than colors
+ */
+static uint64_t virt_color_mask(uint16_t idx, uint16_t nr)
+{
+  uint8_t colors = phys_num_colors();
+  uint8_t per_vm = nr ? colors / nr : colors;
+  uint64_t mask = 0;
+  uint8_t c;
+
+  if (per_vm == 0)
+    per_vm = 1;
+  for (c = 0; c < per_vm; c++)
+    mask |= (uint64_t) 1 << ((idx * per_vm + c) % colors);
+
+  return mask;
+}
+#endif
+
 void virt_init(boot_info_t *info)
 {
+  vm_struct_t *vm;
   uint16_t i, j, cur_cpu = 0;
   uint64_t msr;
   uint32_t ecx;
@@ -376,17 +444,19 @@ void virt_init(boot_info_t *info)
   else
     vmcs_mem_type = 0;
 
-  for (i = 0; i < MAX_CPUS; i++)
-    cpu_to_vm[i] = VM_NONE;
-
   //TODO find vmlinuz and initrd
   //hardcoded 1 vmlinuz and 1 initrd for now
   info->num_mod--;
 
-  vm_structs = (vm_struct_t *) malloc(info->num_mod * sizeof(vm_struct_t));
-  if (vm_structs == NULL)
+  vm = (vm_struct_t *) malloc(info->num_mod * sizeof(vm_struct_t));
+  if (vm == NULL)
     panic("Failed malloc for vm_structs");
 
+  write_lock(&vm_table_lock);
+  for (i = 0; i < MAX_CPUS; i++)
+    cpu_to_vm[i] = VM_NONE;
+  vm_structs = vm;
+
   for (i = 0; i < info->num_mod; i++) {
     memcpy(vm_structs[i].name, info->mod_str[i], strlen(info->mod_str[i]) + 1);
     vm_structs[i].vm_id = i;
@@ -395,9 +465,19 @@ void virt_init(boot_info_t *info)
     vm_structs[i].num_cpus = 0;
     vm_structs[i].ram_size = info->ram_size[i];
     spin_lock_init(&vm_structs[i].lock);
+    virt_mem_init(&vm_structs[i]);
+    /* a VMXON region and a VMCS per CPU */
+    vm_structs[i].mem_quota[VM_MEM_VMX] = 2 * info->num_cpus[i];
 
     if (cur_cpu + info->num_cpus[i] > g_cpus)
       panic("Number of VM CPUs exceeds the available amount");
+    vm_structs[i].node = numa_cpu_node(cur_cpu);
+#ifdef VIRT_PAGE_COLORING
+    vm_structs[i].color_mask = virt_color_mask(i >> 1,
+                                               (info->num_mod + 1) >> 1);
+#else
+    vm_structs[i].color_mask = phys_all_colors();
+#endif
     for (j = 0; j < info->num_cpus[i]; j++)
       cpu_to_vm[cur_cpu++] = i;
 
@@ -408,12 +488,12 @@ void virt_init(boot_info_t *info)
     vm_structs[i - 1].extra_paddr = info->mod_paddr[i];
     vm_structs[i - 1].extra_size = info->mod_size[i];
   }
+  write_unlock(&vm_table_lock);
 }
 
 void virt_percpu_init(void)
 {
   uint16_t cpu = get_pcpu_id();
-  uint16_t vm_id = cpu_to_vm[cpu];
   vm_struct_t *vm;
   uint16_t vcpu_id;
   uint64_t cr0, cr4, msr;
@@ -422,10 +502,13 @@ void virt_percpu_init(void)
   uint64_t ept_p;
   uint64_t flags;
 
-  if (vm_id == VM_NONE)
+  /* held until the guest runs, this CPU stays with 'vm' meanwhile */
+  read_lock(&vm_table_lock);
+  vm = virt_cpu_to_vm(cpu);
+  if (vm == NULL) {
+    read_unlock(&vm_table_lock);
     return;
-
-  vm = &vm_structs[vm_id];
+  }
 
   /* VMX fixed bits in CR0 */
   __asm__ volatile("movq %%cr0, %0\n" : "=r" (cr0));
@@ -450,15 +533,14 @@ void virt_percpu_init(void)
   wrmsr(IA32_FEATURE_CONTROL, msr);
 
   /* VMXON region */
-  vmxon_region[cpu] = alloc_phys_frame();
+  vmxon_region[cpu] = virt_alloc_zeroed_frame(vm, VM_MEM_VMX,
+                                              numa_cpu_node(cpu));
   if (vmxon_region[cpu] == 0)
     panic("VMXON region allocation failed");
-  vmxon_addr = (uint32_t *) vm_map_page(vmxon_region[cpu], 
+  vmxon_addr = (uint32_t *) kmap_atomic(vmxon_region[cpu], 
                                         PGT_P | PGT_RW | vmcs_mem_type);
-  if (vmxon_addr == NULL)
-    panic("VMXON region mapping failed");
   *vmxon_addr = vmcs_rev;
-  vm_unmap_page(vmxon_addr);
+  kunmap_atomic(vmxon_addr);
 
   vmxon(vmxon_region[cpu]);
   virt_check_error(flags);
@@ -468,22 +550,22 @@ void virt_percpu_init(void)
   spin_unlock(&vm->lock);
 
   /* create VMCS */
-  vm->vmcs_paddr[vcpu_id] = alloc_phys_frame();
+  vm->vmcs_paddr[vcpu_id] = virt_alloc_zeroed_frame(vm, VM_MEM_VMX,
+                                                    numa_cpu_node(cpu));
   if (vm->vmcs_paddr[vcpu_id] == 0)
     panic("VMCS allocation failed");
-  vmcs_addr = (uint32_t *) vm_map_page(vm->vmcs_paddr[vcpu_id], 
+  vmcs_addr = (uint32_t *) kmap_atomic(vm->vmcs_paddr[vcpu_id], 
                                        PGT_P | PGT_RW | vmcs_mem_type);
-  if (vmcs_addr == NULL)
-    panic("VMCS mapping failed");
   vmcs_addr[0] = vmcs_rev;
   vmcs_addr[1] = 0;
-  vm_unmap_page(vmcs_addr);
+  kunmap_atomic(vmcs_addr);
 
   vmclear(vm->vmcs_paddr[vcpu_id]);
   vmptrld(vm->vmcs_paddr[vcpu_id]);
   virt_check_error(flags);
 
   ept_p = virt_pg_table_setup(vm);
+  virt_mem_dump(vm);
 
   virt_guest_setup(vm);
 
@@ -491,6 +573,10 @@ void virt_percpu_init(void)
 
   virt_host_setup();
 
+  read_unlock(&vm_table_lock);
+
+  /* no VPID, the TLB is flushed on every VM exit */
+  tlb_cpu_leave();
   __asm__ volatile("vmlaunch" : : : "cc", "memory");
 
   virt_check_error(flags);
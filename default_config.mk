@@ -1,5 +1,25 @@
 # max supported CPUs
 CFG += -DMAX_CPUS=16
 
-# max supported physical memory (GB)
-CFG += -DMM_PHYSICAL_MAX=64
+# 2MB / 1GB frames reserved at boot for guest RAM
+CFG += -DPHYS_HUGE_2M_RESERVE=64
+CFG += -DPHYS_HUGE_1G_RESERVE=0
+
+# claim physical frames with atomics instead of a global lock
+# CFG += -DPHYS_LOCKFREE
+
+# per-VM quotas of guest RAM (MB) and EPT table frames, 0 for no limit
+CFG += -DVIRT_RAM_QUOTA=0
+CFG += -DVIRT_EPT_QUOTA=0
+
+# split LLC page colors between VMs, guest RAM then uses 4KB EPT pages
+# CFG += -DVIRT_PAGE_COLORING
+
+# Two-Level Segregated Fit malloc instead of the buddy allocator
+# CFG += -DMALLOC_TLSF
+
+# time malloc/free at boot, see kernel/mm/malloc_bench.c
+# CFG += -DMALLOC_BENCH
+
+# ticket vs queued spinlock handoffs at boot, see utils/lock_bench.c
+# CFG += -DLOCK_BENCH
@@ -28,6 +28,62 @@ typedef struct _acpi_dmar {
   uint8_t reserved[10];
 } PACKED acpi_dmar_t;
 
+typedef struct _acpi_srat {
+  acpi_header_t header;
+  uint32_t reserved1;
+  uint64_t reserved2;
+} PACKED acpi_srat_t;
+
+typedef struct _acpi_slit {
+  acpi_header_t header;
+  uint64_t localities;
+  uint8_t entry[0];  /* localities * localities */
+} PACKED acpi_slit_t;
+
+typedef struct _srat_header {
+  uint8_t type;
+  uint8_t length;
+} PACKED srat_header_t;
+
+/* SRAT static resource affinity structure types */
+#define SRAT_TYPE_LAPIC     0
+#define SRAT_TYPE_MEMORY    1
+#define SRAT_TYPE_X2APIC    2
+
+/* affinity flags */
+#define SRAT_ENABLED        0x1
+
+typedef struct _srat_lapic {
+  srat_header_t header;
+  uint8_t domain_lo;
+  uint8_t apic_id;
+  uint32_t flags;
+  uint8_t sapic_eid;
+  uint8_t domain_hi[3];
+  uint32_t clock_domain;
+} PACKED srat_lapic_t;
+
+typedef struct _srat_memory {
+  srat_header_t header;
+  uint32_t domain;
+  uint16_t reserved1;
+  uint64_t base_addr;
+  uint64_t length;
+  uint32_t reserved2;
+  uint32_t flags;
+  uint64_t reserved3;
+} PACKED srat_memory_t;
+
+typedef struct _srat_x2apic {
+  srat_header_t header;
+  uint16_t reserved1;
+  uint32_t domain;
+  uint32_t x2apic_id;
+  uint32_t flags;
+  uint32_t clock_domain;
+  uint32_t reserved2;
+} PACKED srat_x2apic_t;
+
 typedef struct _dmar_header {
   uint16_t type;
   uint16_t length;
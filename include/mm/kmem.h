@@ -0,0 +1,52 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+#include "types.h"
+#include "vm.h"
+#include "utils/spinlock.h"
+
+/*
+ * fixed-size object caches on top of malloc: objects are carved from
+ * slabs aligned to KMEM_SLAB_SIZE, each slab belongs to the CPU that
+ * created it and its objects are always freed back to that CPU
+ */
+#define KMEM_SLAB_SIZE PG_SIZE
+#define KMEM_ALIGN_MIN 8
+
+/* per-CPU freelist length before KMEM_CPU_BATCH go to the depot */
+#define KMEM_CPU_MAX 32
+#define KMEM_CPU_BATCH (KMEM_CPU_MAX / 2)
+
+typedef struct _kmem_object {
+  struct _kmem_object *next;
+} kmem_object_t;
+
+/* per-CPU part of a cache, one cache line each */
+typedef struct _kmem_cpu {
+  kmem_object_t *free;  /* only used by its CPU, interrupts off */
+  kmem_object_t *remote;  /* freed by other CPUs, pushed atomically */
+  uint32_t count;  /* objects on 'free' */
+} ALIGNED(64) kmem_cpu_t;
+
+typedef struct _kmem_cache {
+  uint32_t size;  /* object size, multiple of the alignment */
+  uint32_t offset;  /* first object in a slab */
+  uint32_t per_slab;
+  uint32_t slabs;
+  spinlock_t lock;  /* depot and slab count */
+  kmem_object_t *depot;
+  uint32_t depot_count;
+  kmem_cpu_t cpu[MAX_CPUS];
+} kmem_cache_t;
+
+/* header at the start of every slab */
+typedef struct _kmem_slab {
+  kmem_cache_t *cache;
+  uint16_t owner;
+} kmem_slab_t;
+
+extern kmem_cache_t *kmem_cache_create(uint32_t size, uint32_t align);
+extern void *kmem_cache_alloc(kmem_cache_t *cache);
+extern void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+#endif
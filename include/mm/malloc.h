@@ -3,26 +3,44 @@
 
 #include "types.h"
 #include "utils/list.h"
+#include "utils/qspinlock.h"
 
 /* 2~6 MB is static mapping for kernel, malloc pool follows */
 #define MALLOC_BASE ((uint64_t) 0x600000)
 
 #define BUDDY_MIN_ORDER 5
-#define BUDDY_MAX_ORDER 22
+#define BUDDY_MAX_ORDER 21
 
-#define MALLOC_END (MALLOC_BASE + ((uint64_t) 1 << BUDDY_MAX_ORDER))
+/* the heap is made of 2MB arenas, two of them mapped at boot */
+#define MALLOC_ARENA_SIZE ((uint64_t) 1 << BUDDY_MAX_ORDER)
+#define MALLOC_INIT_ARENAS 2
+#define MALLOC_END (MALLOC_BASE + MALLOC_INIT_ARENAS * MALLOC_ARENA_SIZE)
+
+/* arenas added when the heap runs out */
+#define MALLOC_ARENA_BASE ((uint64_t) 0x80000000)
+#define MALLOC_ARENA_LIMIT ((uint64_t) 0xC0000000)
+
+/*
+ * requests larger than MALLOC_LARGE_MIN bypass the buddy
+ * and are mapped page by page into the large-object window
+ */
+#define MALLOC_LARGE_MIN (MALLOC_ARENA_SIZE >> 1)
+#define MALLOC_LARGE_BASE ((uint64_t) 0xC0000000)
+#define MALLOC_LARGE_LIMIT ((uint64_t) 0x100000000)
 
 #define BUDDY_MIN_BLK (1 << BUDDY_MIN_ORDER)
 #define BUDDY_MAX_BLK (1 << BUDDY_MAX_ORDER)
 
-#define USED 0xFF
+/* tag of a used block, ORed with its order entry */
+#define USED 0x80
 
 /*
- * Metadata about this particular block,
- * stored at the beginning of this block.
- * One per free block of memory.
- * There is also 1B meta isFree at the
- * end of the block.
+ * Block metadata is kept out of band in a tag array, one byte per
+ * BUDDY_MIN_BLK of the arena: the byte of the first minimum block of
+ * every block holds its order entry, with USED set while allocated.
+ * Blocks hold no header, so 2^n requests fit exactly and come back
+ * aligned to their size. Free blocks start with a list node.
+ * The tag array of an arena takes the first block of the arena.
  */
 typedef struct _buddy_list
 {
@@ -39,10 +57,81 @@ typedef struct _buddy_bucket
     uint32_t size;
 } buddy_bucket_t;
 
+/*
+ * MALLOC_TLSF backend: free blocks in 2^fl size ranges, each split
+ * into TLSF_SL_COUNT lists, found with two bitmap scans; blocks carry
+ * a 16B header with the size and the previous physical block
+ */
+#define TLSF_SL_BITS 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+#define TLSF_ALIGN 16
+/* sizes below TLSF_SMALL share first level 0, linearly split */
+#define TLSF_FL_SHIFT (TLSF_SL_BITS + 4)
+#define TLSF_SMALL (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (BUDDY_MAX_ORDER - TLSF_FL_SHIFT + 2)
+
+typedef struct _tlsf_block {
+  struct _tlsf_block *prev_phys;  /* valid if TLSF_PREV_FREE is set */
+  uint64_t size;  /* whole block in bytes, flags in the low bits */
+  /* below only in free blocks */
+  struct _tlsf_block *next_free;
+  struct _tlsf_block *prev_free;
+} tlsf_block_t;
+
+#define TLSF_FREE 0x1
+#define TLSF_PREV_FREE 0x2
+#define TLSF_FLAGS 0xF
+#define TLSF_HDR_SIZE (2 * sizeof(uint64_t))
+#define TLSF_MIN_BLOCK sizeof(tlsf_block_t)
+
 #define BUDDY_ENTRIES (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_TAGS (MALLOC_ARENA_SIZE >> BUDDY_MIN_ORDER)
 
 extern void malloc_init(void);
-extern void *malloc(uint32_t size);
+#ifdef MALLOC_BENCH
+extern void malloc_bench(void);
+#endif
+extern void *malloc(uint64_t size);
 extern void free(void *ptr);
 
+/* arenas and large objects, kernel/mm/heap.c */
+extern void heap_init(void);
+extern bool heap_map_arena(uint64_t vaddr);
+extern uint64_t heap_grow(void);
+extern void *heap_alloc_large(uint64_t size, void *site);
+extern void heap_free_large(void *ptr);
+
+/*
+ * heap statistics, kernel/mm/heap_stats.c, always on: splits, merges
+ * and lock counts are kept under the backend heap lock, the rest is
+ * counted with atomics
+ */
+#define HEAP_SITES 64
+
+typedef struct _heap_site {
+  uint64_t site;  /* return address of the malloc caller, 0 if unused */
+  uint64_t count;
+  uint64_t bytes;
+} heap_site_t;
+
+typedef struct _heap_stats {
+  uint64_t live;  /* bytes in used blocks, large objects included */
+  uint64_t peak;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t fails;
+  uint64_t large;  /* allocations served by the large-object window */
+  uint64_t splits;
+  uint64_t merges;
+  uint64_t lock_acquires;  /* of the backend heap lock */
+  uint64_t lock_wait;  /* cycles spent spinning on it */
+  uint64_t lock_wait_max;
+} heap_stats_t;
+
+extern heap_stats_t heap_stats;
+extern void heap_stat_alloc(void *site, uint64_t bytes);
+extern void heap_stat_free(uint64_t bytes);
+extern void heap_lock(qspinlock_t *lock);
+extern void heap_dump_stats(void);
+
 #endif
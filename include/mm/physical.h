@@ -4,18 +4,89 @@
 #include "types.h"
 #include "vm.h"
 
-#define MM_TABLE_MAX (((uint64_t) MM_PHYSICAL_MAX * 1024 * 1024 * 1024) / (8 * sizeof(uint64_t) * PG_SIZE))
+/*
+ * mm_table is allocated at boot in 1GB sections, only for sections
+ * the memory map reports RAM in, and reached through a section table
+ */
+#define MM_SECTION_BITS (HUGE_PG_BITS - PG_BITS)
+#define MM_SECTION_FRAMES ((uint64_t) 1 << MM_SECTION_BITS)
+#define MM_SECTION_WORDS (MM_SECTION_FRAMES >> 6)
+#define MM_SECTIONS_MAX (1 << 16)
+
+/* summary bitmaps over mm_table, one bit per word of the level below */
+#define MM_SUMMARY_LEVELS 3
+
+/* virtual window of the boot-time allocated allocator metadata */
+#define PHYS_META_BASE ((uint64_t) 0x40000000)
+#define PHYS_META_LIMIT ((uint64_t) 0x80000000)
+
+#define MM_NONE UINT64_MAX
+
+/* frames below 1MB are only given out by alloc_phys_frame_lowmem */
+#define MM_LOWMEM_FRAMES (0x100000 >> PG_BITS)
+
+/* free-extent index granularity: a large page worth of frames */
+#define PHYS_CHUNK_BITS (LARGE_PG_BITS - PG_BITS)
+#define PHYS_CHUNK_FRAMES (1 << PHYS_CHUNK_BITS)
+#define PHYS_EXTENT_CLASSES 32
+#define PHYS_EXTENT_NONE UINT32_MAX
+
+/* NUMA zones, one per SRAT memory affinity entry */
+#define PHYS_ZONES_MAX 32
+
+/* boot-time pools of 2MB / 1GB frames, sizes from config.mk */
+#ifndef PHYS_HUGE_2M_RESERVE
+#define PHYS_HUGE_2M_RESERVE 0
+#endif
+#ifndef PHYS_HUGE_1G_RESERVE
+#define PHYS_HUGE_1G_RESERVE 0
+#endif
+
+/* pre-zeroed frames per NUMA node, refilled by idle CPUs */
+#define PHYS_ZERO_POOL 64
+
+/* per-CPU single frame cache, refilled/drained PHYS_MAG_BATCH at a time */
+#define PHYS_MAG_SIZE 64
+#define PHYS_MAG_BATCH 32
+
+/*
+ * page colors from the LLC geometry, one mm_table word covers every
+ * color; per-color frame stacks are refilled PHYS_COLOR_BATCH at a time
+ */
+#define PHYS_COLORS_MAX 64
+#define PHYS_COLOR_POOL 64
+#define PHYS_COLOR_BATCH 32
 
 extern void physical_free_range(uint64_t begin, uint64_t length);
 extern void physical_take_range(uint64_t begin, uint64_t length);
 extern bool physical_is_free(uint64_t addr);
-extern void physical_set_limit(uint64_t limit);
+extern void physical_add_section(uint64_t begin, uint64_t length);
+extern uint64_t physical_meta_size(uint64_t limit);
+extern void physical_init(uint64_t limit, uint64_t meta, uint64_t size);
+extern void physical_add_zone(uint8_t node, uint64_t begin, uint64_t length);
 extern void physical_check_table(void);
 extern void physical_next_free_range(uint64_t current, uint64_t *start, uint64_t *size);
 extern uint64_t alloc_phys_frame(void);
 extern uint64_t alloc_phys_frames(uint64_t num);
 extern uint64_t alloc_phys_frames_aligned(uint64_t num, uint64_t align);
 extern uint64_t alloc_phys_frame_lowmem(void);
+extern uint64_t alloc_phys_frame_node(uint8_t node);
+extern uint64_t alloc_phys_frames_node(uint64_t num, uint8_t node);
+extern uint64_t alloc_phys_frames_aligned_node(uint64_t num, uint64_t align,
+                                               uint8_t node);
+extern void physical_reserve_huge(void);
+extern uint64_t alloc_phys_huge_frame(uint64_t size);
+extern void free_phys_huge_frame(uint64_t frame, uint64_t size);
+extern uint64_t phys_huge_frames_left(uint64_t size);
+extern uint64_t alloc_zeroed_phys_frame(void);
+extern uint64_t alloc_zeroed_phys_frame_node(uint8_t node);
+extern bool physical_zero_refill(void);
+extern void physical_init_colors(void);
+extern uint8_t phys_num_colors(void);
+extern uint64_t phys_all_colors(void);
+extern uint8_t phys_frame_color(uint64_t frame);
+extern uint64_t alloc_phys_frame_color(uint64_t colors);
+extern void free_phys_frame_color(uint64_t frame);
 extern void free_phys_frame(uint64_t frame);
 extern void free_phys_frames(uint64_t frame, uint64_t num);
 
@@ -0,0 +1,39 @@
+#ifndef _VRANGE_H_
+#define _VRANGE_H_
+
+#include "types.h"
+#include "utils/spinlock.h"
+
+/* nodes shared by all allocators, one per free or used range */
+#define VRANGE_NODES 2048
+
+typedef struct _vrange_node {
+  uint64_t start;
+  uint64_t size;
+  uint64_t max;  /* largest size in the subtree */
+  struct _vrange_node *left;
+  struct _vrange_node *right;
+  uint32_t height;
+} vrange_node_t;
+
+/*
+ * virtual address range allocator over [base, limit): free ranges
+ * are kept in an AVL tree by address, augmented with the largest free
+ * size below each node, so the lowest fitting range is found in
+ * O(log n) and neighbours coalesce on free; used ranges are kept in
+ * a second tree to find their size on free
+ */
+typedef struct _vrange {
+  vrange_node_t *free;
+  vrange_node_t *used;
+  uint64_t granularity;
+  spinlock_t lock;
+} vrange_t;
+
+extern void vrange_init(vrange_t *vr, uint64_t base, uint64_t limit,
+                        uint64_t granularity);
+extern uint64_t vrange_alloc(vrange_t *vr, uint64_t size, uint64_t align);
+extern uint64_t vrange_size(vrange_t *vr, uint64_t addr);
+extern uint64_t vrange_free(vrange_t *vr, uint64_t addr);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include "types.h"
+
+/* node id == ACPI proximity domain, larger domains fold into node 0 */
+#define MAX_NUMA_NODES 8
+#define NUMA_NODE_NONE 0xFF
+
+/* SLIT distances, relative to 10 for local access */
+#define NUMA_DISTANCE_LOCAL 10
+#define NUMA_DISTANCE_REMOTE 20
+
+extern void numa_add_cpu(uint32_t apic_id, uint32_t domain);
+extern void numa_add_memory(uint32_t domain, uint64_t begin, uint64_t length);
+extern void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance);
+extern void numa_set_cpu_node(uint16_t cpu, uint8_t node);
+extern uint8_t numa_node_of_apic(uint32_t apic_id);
+extern uint8_t numa_cpu_node(uint16_t cpu);
+extern uint8_t numa_local_node(void);
+extern uint8_t numa_node_order(uint8_t node, uint8_t *order);
+extern void numa_init(void);
+
+#endif
@@ -28,6 +28,21 @@ static inline uint8_t count_trailing_zeros_bit64(uint64_t data)
   return (uint8_t) __builtin_ctzll(data);
 }
 
+/* when data is 0, result is undefined */
+static inline uint8_t count_leading_zeros_bit64(uint64_t data)
+{
+  return (uint8_t) __builtin_clzll(data);
+}
+
+/* number of set bits, open-coded to avoid the libgcc helper */
+static inline uint8_t count_bits64(uint64_t data)
+{
+  data = data - ((data >> 1) & 0x5555555555555555);
+  data = (data & 0x3333333333333333) + ((data >> 2) & 0x3333333333333333);
+  data = (data + (data >> 4)) & 0x0F0F0F0F0F0F0F0F;
+  return (uint8_t) ((data * 0x0101010101010101) >> 56);
+}
+
 static inline uint8_t bitmap64_get(uint64_t *map, uint64_t index)
 {
   return (map[index >> 6] & ((uint64_t) 1 << (index & 63))) > 0 ? 1 : 0;
@@ -8,4 +8,9 @@ static inline uint64_t ceiling64(uint64_t data, uint64_t base)
   return ((data + base - 1) / base) * base;
 }
 
+static inline uint64_t max64(uint64_t a, uint64_t b)
+{
+  return a > b ? a : b;
+}
+
 #endif
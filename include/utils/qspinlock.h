@@ -0,0 +1,63 @@
+#ifndef _QSPINLOCK_H_
+#define _QSPINLOCK_H_
+
+#include "types.h"
+#include "cpu.h"
+#include "atomic.h"
+
+/*
+ * Queued spinlock: same use as spinlock_t, but waiters line up in
+ * an MCS queue of per-CPU nodes and each spins on its own node, only
+ * the head of the queue watches the lock word. 'tail' encodes the
+ * CPU and nesting level of the last waiter, 0 if none.
+ */
+typedef union _qspinlock {
+  uint64_t data;
+  struct {
+    volatile uint32_t locked;
+    volatile uint32_t tail;
+  } obj;
+} qspinlock_t;
+
+#define QSPINLOCK_UNLOCKED {.data = 0}
+
+/* nodes per CPU: a lock may be taken in an interrupt while waiting */
+#define QSPIN_NESTING 4
+
+typedef struct _qspin_node {
+  struct _qspin_node *volatile next;
+  volatile uint32_t wait;
+} ALIGNED(64) qspin_node_t;
+
+extern void qspin_lock_slow(qspinlock_t *lock);
+#ifdef LOCK_BENCH
+extern void lock_bench(void);
+#endif
+
+static inline void qspin_lock_init(qspinlock_t *lock)
+{
+  atomic_store(&lock->data, 0);
+}
+
+static inline void qspin_lock(qspinlock_t *lock)
+{
+  uint64_t data = 0;
+
+  if (!atomic_cmp_xchg(&lock->data, &data, 1))
+    qspin_lock_slow(lock);
+}
+
+static inline void qspin_unlock(qspinlock_t *lock)
+{
+  atomic_store(&lock->obj.locked, 0);
+}
+
+/* return true if acquired lock */
+static inline bool qspin_trylock(qspinlock_t *lock)
+{
+  uint64_t data = 0;
+
+  return atomic_cmp_xchg(&lock->data, &data, 1);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef _RWLOCK_H_
+#define _RWLOCK_H_
+
+#include "types.h"
+#include "cpu.h"
+#include "atomic.h"
+
+/*
+ * Reader-writer spinlock: 'data' holds the reader count and the
+ * writer bits. A writer-preferring lock stops admitting readers once
+ * a writer waits, so a stream of readers cannot starve writers; the
+ * default lets readers in whenever no writer holds the lock.
+ * Readers write the lock word, use seqlock_t on paths where they
+ * must not.
+ */
+#define RWLOCK_WRITER 0x80000000
+#define RWLOCK_WAITING 0x40000000
+#define RWLOCK_READERS 0x3FFFFFFF
+
+typedef struct _rwlock {
+  uint32_t data;
+  bool prefer_writer;
+} rwlock_t;
+
+#define RWLOCK_UNLOCKED {.data = 0, .prefer_writer = false}
+#define RWLOCK_UNLOCKED_WRITER_PREF {.data = 0, .prefer_writer = true}
+
+static inline void rwlock_init(rwlock_t *lock, bool prefer_writer)
+{
+  lock->prefer_writer = prefer_writer;
+  atomic_store(&lock->data, 0);
+}
+
+/* return true if acquired lock */
+static inline bool read_trylock(rwlock_t *lock)
+{
+  uint32_t data = atomic_load(&lock->data);
+  uint32_t busy = lock->prefer_writer ? RWLOCK_WRITER | RWLOCK_WAITING
+                                      : RWLOCK_WRITER;
+
+  if (data & busy)
+    return false;
+
+  return atomic_cmp_xchg(&lock->data, &data, data + 1);
+}
+
+static inline void read_lock(rwlock_t *lock)
+{
+  while (!read_trylock(lock))
+    pause();
+}
+
+static inline void read_unlock(rwlock_t *lock)
+{
+  atomic_fetch_add(&lock->data, -1);
+}
+
+/* return true if acquired lock */
+static inline bool write_trylock(rwlock_t *lock)
+{
+  uint32_t data = atomic_load(&lock->data);
+
+  if (data & (RWLOCK_WRITER | RWLOCK_READERS))
+    return false;
+
+  /* the waiting bit goes with it, other writers set it again */
+  return atomic_cmp_xchg(&lock->data, &data, RWLOCK_WRITER);
+}
+
+static inline void write_lock(rwlock_t *lock)
+{
+  while (!write_trylock(lock)) {
+    if (lock->prefer_writer
+        && !(atomic_load(&lock->data) & RWLOCK_WAITING))
+      atomic_fetch_or(&lock->data, RWLOCK_WAITING);
+    pause();
+  }
+}
+
+static inline void write_unlock(rwlock_t *lock)
+{
+  atomic_fetch_and(&lock->data, ~RWLOCK_WRITER);
+}
+
+#endif
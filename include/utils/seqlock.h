@@ -0,0 +1,60 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include "types.h"
+#include "cpu.h"
+#include "atomic.h"
+#include "utils/spinlock.h"
+
+/*
+ * Sequence lock for read-mostly data: writers serialize on 'lock' and
+ * keep 'seq' odd while writing, readers only load 'seq' and retry if
+ * it moved, so they never write a shared cache line. Readers must not
+ * follow pointers that a writer may free.
+ */
+typedef struct _seqlock {
+  volatile uint32_t seq;
+  spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_UNLOCKED {.seq = 0, .lock = SPINLOCK_UNLOCKED}
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+  atomic_store(&sl->seq, 0);
+  spin_lock_init(&sl->lock);
+}
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+  spin_lock(&sl->lock);
+  atomic_increment(&sl->seq);
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+  atomic_increment(&sl->seq);
+  spin_unlock(&sl->lock);
+}
+
+/* start of a read section, waits out a writer in progress */
+static inline uint32_t read_seqbegin(seqlock_t *sl)
+{
+  uint32_t seq;
+
+  while ((seq = atomic_load(&sl->seq)) & 1)
+    pause();
+  /* x86 keeps loads in order, only the compiler needs a fence */
+  compiler_barrier();
+
+  return seq;
+}
+
+/* return true if the section begun with 'seq' must be read again */
+static inline bool read_seqretry(seqlock_t *sl, uint32_t seq)
+{
+  compiler_barrier();
+  return atomic_load(&sl->seq) != seq;
+}
+
+#endif
@@ -24,6 +24,9 @@
 #include "apic.h"
 #include "smp.h"
 #include "virt/iommu.h"
+#include "numa.h"
+#include "utils/math.h"
+#include "utils/seqlock.h"
 
 uint16_t g_cpus = 1;
 
@@ -34,6 +37,8 @@ struct {
 } irq_map[MAX_IRQ_OVERRIDES];
 
 uint8_t num_overrides = 0;
+/* irq_map and num_overrides, read on interrupt setup paths */
+static seqlock_t irq_map_lock = SEQLOCK_UNLOCKED;
 
 static uint16_t num_ioapic = 0;
 static uint8_t lapic_ids[MAX_CPUS];
@@ -102,12 +107,14 @@ static void acpi_parse_apic(acpi_madt_t *madt)
       apic_interruptoverride_t *s = (apic_interruptoverride_t *) p;
       if (s->bus != 0)
         panic("Only bus 0 is supported");
+      if (num_overrides >= MAX_IRQ_OVERRIDES)
+        panic("Exceeds supported max overrides");
+      write_seqlock(&irq_map_lock);
       irq_map[num_overrides].irq = s->irq;
       irq_map[num_overrides].gsi = s->gsi;
       irq_map[num_overrides].flags = s->flags;
       num_overrides++;
-      if (num_overrides > MAX_IRQ_OVERRIDES)
-        panic("Exceeds supported max overrides");
+      write_sequnlock(&irq_map_lock);
       //printf("Found Interrupt Override: %d %d %d 0x%04x\n", s->bus, s->irq, s->gsi, s->flags);
     } else {
       //printf("Unsupported APIC structure %d\n", type);
@@ -142,6 +149,53 @@ static void acpi_parse_dmar(acpi_dmar_t *dmar)
   }
 }
 
+static void acpi_parse_srat(acpi_srat_t *srat)
+{
+  uint8_t *p, *end;
+
+  p = (uint8_t *) (srat + 1);
+  end = (uint8_t *) srat + srat->header.length;
+
+  while (p < end) {
+    srat_header_t *header = (srat_header_t *) p;
+    uint8_t type = header->type;
+    uint8_t length = header->length;
+
+    if (length == 0)
+      panic("Malformed SRAT");
+
+    if (type == SRAT_TYPE_LAPIC) {
+      srat_lapic_t *s = (srat_lapic_t *) p;
+      if (s->flags & SRAT_ENABLED)
+        numa_add_cpu(s->apic_id, s->domain_lo | (s->domain_hi[0] << 8)
+                     | (s->domain_hi[1] << 16) | (s->domain_hi[2] << 24));
+    } else if (type == SRAT_TYPE_MEMORY) {
+      srat_memory_t *s = (srat_memory_t *) p;
+      if ((s->flags & SRAT_ENABLED) && s->length)
+        numa_add_memory(s->domain, s->base_addr, s->length);
+    } else if (type == SRAT_TYPE_X2APIC) {
+      srat_x2apic_t *s = (srat_x2apic_t *) p;
+      if (s->flags & SRAT_ENABLED)
+        numa_add_cpu(s->x2apic_id, s->domain);
+    }
+
+    p += length;
+  }
+}
+
+static void acpi_parse_slit(acpi_slit_t *slit)
+{
+  uint64_t i, j, n = slit->localities;
+
+  if (sizeof(acpi_slit_t) + n * n > slit->header.length)
+    panic("Malformed SLIT");
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++)
+      numa_set_distance(i, j, slit->entry[i * n + j]);
+  }
+}
+
 static void acpi_parse_dt(acpi_header_t *header)
 {
   //char sigstr[5];
@@ -153,6 +207,46 @@ static void acpi_parse_dt(acpi_header_t *header)
     acpi_parse_apic((acpi_madt_t *) header);
   else if (header->signature == 0x52414D44)
     acpi_parse_dmar((acpi_dmar_t *) header);
+  else if (header->signature == 0x54415253)
+    acpi_parse_srat((acpi_srat_t *) header);
+  else if (header->signature == 0x54494C53)
+    acpi_parse_slit((acpi_slit_t *) header);
+}
+
+/*
+ * map the description table at 'address' as a whole,
+ * number of pages mapped returned in 'pages'
+ */
+static acpi_header_t *acpi_map_dt(uint64_t address, uint64_t *pages)
+{
+  uint64_t page_start = address & PGT_MASK;
+  uint64_t num;
+  uint8_t *va;
+
+  /* two pages in case the header spans across page boundary */
+  va = (uint8_t *) vm_map_pages(page_start, 2, PGT_P | PGT_XD);
+  if (va == NULL)
+    panic("Failed to map ACPI table");
+  num = ceiling64(address - page_start
+                  + ((acpi_header_t *) (va + address - page_start))->length,
+                  PG_SIZE) >> PG_BITS;
+
+  /* SRAT of a large machine is several pages */
+  if (num > 2) {
+    vm_unmap_pages(va, 2);
+    va = (uint8_t *) vm_map_pages(page_start, num, PGT_P | PGT_XD);
+    if (va == NULL)
+      panic("Failed to map ACPI table");
+  } else
+    num = 2;
+
+  *pages = num;
+  return (acpi_header_t *) (va + address - page_start);
+}
+
+static inline void acpi_unmap_dt(acpi_header_t *dt, uint64_t pages)
+{
+  vm_unmap_pages((void *) ((uint64_t) dt & PGT_MASK), pages);
 }
 
 static void acpi_parse_rsdt(uint32_t rsdt)
@@ -168,12 +262,10 @@ static void acpi_parse_rsdt(uint32_t rsdt)
     panic("RSDT is too large");
 
   while (sdt < end) {
-    uint64_t address = (uint64_t) *sdt++;
-    page_start = address & PGT_MASK;
-    uint8_t *va2 = (uint8_t *) vm_map_pages((uint64_t) page_start, 2, PGT_P | PGT_XD);
-    acpi_header_t *dt_p = (acpi_header_t *) (va2 + address - page_start);
+    uint64_t pages;
+    acpi_header_t *dt_p = acpi_map_dt((uint64_t) *sdt++, &pages);
     acpi_parse_dt(dt_p);
-    vm_unmap_pages(va2, 2);
+    acpi_unmap_dt(dt_p, pages);
   }
 
   vm_unmap_pages(va, 2);
@@ -192,12 +284,10 @@ static void acpi_parse_xsdt(uint64_t xsdt)
     panic("XSDT is too large");
 
   while (sdt < end) {
-    uint64_t address = *sdt++;
-    page_start = (address >> PG_BITS) << PG_BITS;
-    uint8_t *va2 = (uint8_t *) vm_map_pages((uint64_t) page_start, 2, PGT_P | PGT_XD);
-    acpi_header_t *dt_p = (acpi_header_t *) (va2 + address - page_start);
+    uint64_t pages;
+    acpi_header_t *dt_p = acpi_map_dt(*sdt++, &pages);
     acpi_parse_dt(dt_p);
-    vm_unmap_pages(va2, 2);
+    acpi_unmap_dt(dt_p, pages);
   }
 
   vm_unmap_pages(va, 2);
@@ -276,22 +366,32 @@ void acpi_init(uint8_t *rsdp)
     panic("Can't find RSDP");
 
 END:
+  numa_init();
+
   if (g_cpus > 1)
     memcpy((uint8_t *) SMP_BOOT_ADDR, ap_boot_start, ap_boot_end - ap_boot_start);
 }
 
 uint32_t acpi_irq_to_gsi(uint8_t irq, uint16_t *flags)
 {
+  uint32_t seq, gsi;
+  uint16_t gsi_flags;
   uint8_t i;
-  for (i = 0; i < num_overrides; i++) {
-    if (irq_map[i].irq == irq) {
-      if (flags)
-        *flags = irq_map[i].flags;
-      return irq_map[i].gsi;
+
+  do {
+    seq = read_seqbegin(&irq_map_lock);
+    gsi = irq;
+    gsi_flags = 0;
+    for (i = 0; i < num_overrides; i++) {
+      if (irq_map[i].irq == irq) {
+        gsi_flags = irq_map[i].flags;
+        gsi = irq_map[i].gsi;
+        break;
+      }
     }
-  }
+  } while (read_seqretry(&irq_map_lock, seq));
 
   if (flags)
-    *flags = 0;
-  return (uint32_t) irq;
+    *flags = gsi_flags;
+  return gsi;
 }
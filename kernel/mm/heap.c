@@ -0,0 +1,117 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mm/malloc.h"
+#include "vm.h"
+#include "debug.h"
+#include "mm/physical.h"
+#include "utils/math.h"
+#include "mm/vrange.h"
+
+/* where the next arena gets mapped */
+static uint64_t arena_next = MALLOC_ARENA_BASE;
+
+/* back the arena at 'vaddr' with a 2MB frame, false if out of memory */
+bool heap_map_arena(uint64_t vaddr)
+{
+  uint64_t paddr;
+
+  paddr = alloc_phys_frames_aligned(MALLOC_ARENA_SIZE >> PG_BITS,
+                                    LARGE_PG_SIZE);
+  if (paddr == 0)
+    return false;
+
+  /* malloc memory is not executable, set XD */
+  vm_map_large_page_unrestricted(paddr, PGT_P | PGT_RW | PGT_XD | PDT_PS
+                                 | PGT_G, vaddr);
+  return true;
+}
+
+/*
+ * map one more arena for the allocator backend, return its address,
+ * 0 if out of memory; callers serialize on their heap lock
+ */
+uint64_t heap_grow(void)
+{
+  uint64_t base = arena_next;
+
+  if (base >= MALLOC_ARENA_LIMIT || !heap_map_arena(base))
+    return 0;
+
+  arena_next += MALLOC_ARENA_SIZE;
+  return base;
+}
+
+/*
+ * Large objects: page-granular mappings of single frames in the
+ * window [MALLOC_LARGE_BASE, MALLOC_LARGE_LIMIT)
+ */
+static vrange_t large_vr;
+
+void heap_init(void)
+{
+  vrange_init(&large_vr, MALLOC_LARGE_BASE, MALLOC_LARGE_LIMIT, PG_SIZE);
+}
+
+/*
+ * 'size' bytes of page-aligned memory, NULL if fail,
+ * accounted to the malloc caller at 'site'
+ */
+void *heap_alloc_large(uint64_t size, void *site)
+{
+  uint64_t num = ceiling64(size, PG_SIZE) >> PG_BITS;
+  uint64_t frame, i;
+  uint8_t *va;
+
+  va = (uint8_t *) vrange_alloc(&large_vr, num << PG_BITS, 0);
+  if (va == NULL) {
+    atomic_increment(&heap_stats.fails);
+    return NULL;
+  }
+
+  /* frames need not be contiguous, map them one by one */
+  for (i = 0; i < num; i++) {
+    frame = alloc_phys_frame();
+    if (frame == 0) {
+      if (i > 0)
+        vm_unmap_free_pages(va, i);
+      vrange_free(&large_vr, (uint64_t) va);
+      atomic_increment(&heap_stats.fails);
+      return NULL;
+    }
+    /* malloc memory is not executable, set XD */
+    vm_map_page_unrestricted(frame, PGT_P | PGT_RW | PGT_XD | PGT_G,
+                             (uint64_t) va + (i << PG_BITS));
+  }
+
+  atomic_increment(&heap_stats.large);
+  heap_stat_alloc(site, num << PG_BITS);
+  return va;
+}
+
+void heap_free_large(void *ptr)
+{
+  uint64_t size = vrange_size(&large_vr, (uint64_t) ptr);
+
+  if (size == 0)
+    panic("Invalid free of a large object");
+
+  /* the range is given back only once its pages are flushed */
+  vm_unmap_free_pages(ptr, size >> PG_BITS);
+  vrange_free(&large_vr, (uint64_t) ptr);
+  heap_stat_free(size);
+}
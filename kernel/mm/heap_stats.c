@@ -0,0 +1,133 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mm/malloc.h"
+#include "cpu.h"
+#include "atomic.h"
+#include "utils/screen.h"
+#include "utils/qspinlock.h"
+
+heap_stats_t heap_stats = {0};
+
+/*
+ * open-addressed table of malloc call sites, entries are claimed
+ * with cmpxchg and never released; allocations from sites that no
+ * longer fit are counted in site_other
+ */
+static heap_site_t sites[HEAP_SITES] = {{0}};
+static heap_site_t site_other = {0};
+
+static inline uint32_t site_hash(uint64_t site)
+{
+  /* Fibonacci hashing, HEAP_SITES is a power of two */
+  return ((site >> 2) * 0x9E3779B97F4A7C15ULL) >> 58;
+}
+
+static heap_site_t *site_lookup(uint64_t site)
+{
+  uint32_t i, idx = site_hash(site);
+  uint64_t key;
+
+  for (i = 0; i < HEAP_SITES; i++) {
+    key = atomic_load(&sites[idx].site);
+    if (key == 0) {
+      /* if another CPU got there first, it may be the same site */
+      if (atomic_cmp_xchg(&sites[idx].site, &key, site) || key == site)
+        return &sites[idx];
+    } else if (key == site)
+      return &sites[idx];
+    idx = (idx + 1) & (HEAP_SITES - 1);
+  }
+
+  return &site_other;
+}
+
+/* 'bytes' of heap handed out to the caller at 'site' */
+void heap_stat_alloc(void *site, uint64_t bytes)
+{
+  heap_site_t *s = site_lookup((uint64_t) site);
+  uint64_t live, peak;
+
+  atomic_increment(&s->count);
+  atomic_fetch_add(&s->bytes, bytes);
+  atomic_increment(&heap_stats.allocs);
+
+  live = atomic_fetch_add(&heap_stats.live, bytes) + bytes;
+  peak = atomic_load(&heap_stats.peak);
+  while (live > peak && !atomic_cmp_xchg(&heap_stats.peak, &peak, live))
+    ;
+}
+
+void heap_stat_free(uint64_t bytes)
+{
+  atomic_increment(&heap_stats.frees);
+  atomic_fetch_add(&heap_stats.live, -bytes);
+}
+
+/* qspin_lock that accounts the cycles spent waiting for 'lock' */
+void heap_lock(qspinlock_t *lock)
+{
+  uint64_t start = rdtsc();
+  uint64_t wait;
+
+  qspin_lock(lock);
+  wait = rdtsc() - start;
+
+  heap_stats.lock_acquires++;
+  heap_stats.lock_wait += wait;
+  if (wait > heap_stats.lock_wait_max)
+    heap_stats.lock_wait_max = wait;
+}
+
+/* print the counters and the call sites, heaviest first */
+void heap_dump_stats(void)
+{
+  heap_site_t snap[HEAP_SITES], tmp;
+  uint32_t i, j, num = 0;
+  uint64_t acquires = heap_stats.lock_acquires;
+
+  printf("heap: live %llu peak %llu bytes, %llu allocs %llu frees "
+         "%llu failed %llu large\n",
+         heap_stats.live, heap_stats.peak, heap_stats.allocs,
+         heap_stats.frees, heap_stats.fails, heap_stats.large);
+  printf("heap: %llu splits %llu merges, lock %llu acquires, wait "
+         "avg %llu max %llu cycles\n",
+         heap_stats.splits, heap_stats.merges, acquires,
+         acquires ? heap_stats.lock_wait / acquires : 0,
+         heap_stats.lock_wait_max);
+
+  for (i = 0; i < HEAP_SITES; i++) {
+    if (atomic_load(&sites[i].site) != 0)
+      snap[num++] = sites[i];
+  }
+
+  /* insertion sort by bytes, the table is small */
+  for (i = 1; i < num; i++) {
+    tmp = snap[i];
+    for (j = i; j > 0 && snap[j - 1].bytes < tmp.bytes; j--)
+      snap[j] = snap[j - 1];
+    snap[j] = tmp;
+  }
+
+  for (i = 0; i < num; i++)
+    printf("  site %llX: %llu allocs %llu bytes\n",
+           snap[i].site, snap[i].count, snap[i].bytes);
+  if (site_other.count)
+    printf("  other sites: %llu allocs %llu bytes\n",
+           site_other.count, site_other.bytes);
+}
@@ -0,0 +1,206 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mm/kmem.h"
+#include "mm/malloc.h"
+#include "debug.h"
+#include "percpu.h"
+#include "interrupt.h"
+#include "atomic.h"
+#include "utils/math.h"
+
+
+/*
+ * 'size' byte objects aligned to 'align' (2^n, at most KMEM_SLAB_SIZE / 2),
+ * usable after malloc_init and percpu_init
+ */
+kmem_cache_t *kmem_cache_create(uint32_t size, uint32_t align)
+{
+  kmem_cache_t *cache;
+  void *mem;
+  uint32_t i;
+
+  if (align < KMEM_ALIGN_MIN)
+    align = KMEM_ALIGN_MIN;
+  if (size < sizeof(kmem_object_t))
+    size = sizeof(kmem_object_t);
+  size = ceiling64(size, align);
+
+  /* caches are never destroyed, malloc only aligns to 16 bytes */
+  mem = malloc(sizeof(kmem_cache_t) + 63);
+  if (mem == NULL)
+    return NULL;
+  cache = (kmem_cache_t *) ceiling64((uint64_t) mem, 64);
+
+  cache->size = size;
+  cache->offset = ceiling64(sizeof(kmem_slab_t), align);
+  if (cache->offset + size > KMEM_SLAB_SIZE)
+    panic("kmem object too large for a slab");
+  cache->per_slab = (KMEM_SLAB_SIZE - cache->offset) / size;
+  cache->slabs = 0;
+  spin_lock_init(&cache->lock);
+  cache->depot = NULL;
+  cache->depot_count = 0;
+
+  for (i = 0; i < MAX_CPUS; i++) {
+    cache->cpu[i].free = NULL;
+    cache->cpu[i].remote = NULL;
+    cache->cpu[i].count = 0;
+  }
+
+  return cache;
+}
+
+/*
+ * carve a new slab owned by 'cpu' onto its freelist,
+ * return false if out of memory, interrupts off
+ */
+static bool kmem_slab_new(kmem_cache_t *cache, kmem_cpu_t *c, uint16_t cpu)
+{
+  kmem_slab_t *slab;
+  kmem_object_t *obj;
+  uint8_t *pos;
+  uint32_t i;
+
+  /* malloc'd blocks of 2^n bytes are aligned to their size */
+  slab = (kmem_slab_t *) malloc(KMEM_SLAB_SIZE);
+  if (slab == NULL)
+    return false;
+
+  slab->cache = cache;
+  slab->owner = cpu;
+
+  pos = (uint8_t *) slab + cache->offset;
+  for (i = 0; i < cache->per_slab; i++) {
+    obj = (kmem_object_t *) pos;
+    obj->next = c->free;
+    c->free = obj;
+    pos += cache->size;
+  }
+  c->count += cache->per_slab;
+
+  spin_lock(&cache->lock);
+  cache->slabs++;
+  spin_unlock(&cache->lock);
+
+  return true;
+}
+
+/*
+ * refill the empty freelist of 'cpu': objects freed by other CPUs
+ * first, then a batch from the depot, then a new slab; interrupts off
+ */
+static void kmem_refill(kmem_cache_t *cache, kmem_cpu_t *c, uint16_t cpu)
+{
+  kmem_object_t *obj;
+
+  c->free = atomic_exchange(&c->remote, NULL);
+  for (obj = c->free; obj; obj = obj->next)
+    c->count++;
+  if (c->free)
+    return;
+
+  spin_lock(&cache->lock);
+  while (cache->depot && c->count < KMEM_CPU_BATCH) {
+    obj = cache->depot;
+    cache->depot = obj->next;
+    cache->depot_count--;
+    obj->next = c->free;
+    c->free = obj;
+    c->count++;
+  }
+  spin_unlock(&cache->lock);
+
+  if (c->free == NULL)
+    kmem_slab_new(cache, c, cpu);
+}
+
+/* return an object of 'cache', NULL if out of memory */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+  kmem_object_t *obj;
+  kmem_cpu_t *c;
+  uint16_t cpu;
+  uint64_t flag;
+
+  interrupt_disable_save(&flag);
+
+  cpu = get_pcpu_id();
+  c = &cache->cpu[cpu];
+  if (c->free == NULL)
+    kmem_refill(cache, c, cpu);
+
+  obj = c->free;
+  if (obj) {
+    c->free = obj->next;
+    c->count--;
+  }
+
+  interrupt_enable_restore(flag);
+  return obj;
+}
+
+/* move KMEM_CPU_BATCH objects from a full freelist to the depot */
+static void kmem_flush(kmem_cache_t *cache, kmem_cpu_t *c)
+{
+  kmem_object_t *obj;
+  uint32_t i;
+
+  spin_lock(&cache->lock);
+  for (i = 0; i < KMEM_CPU_BATCH; i++) {
+    obj = c->free;
+    c->free = obj->next;
+    obj->next = cache->depot;
+    cache->depot = obj;
+  }
+  cache->depot_count += KMEM_CPU_BATCH;
+  spin_unlock(&cache->lock);
+
+  c->count -= KMEM_CPU_BATCH;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *ptr)
+{
+  kmem_slab_t *slab = (kmem_slab_t *) ((uint64_t) ptr
+                                       & ~((uint64_t) KMEM_SLAB_SIZE - 1));
+  kmem_object_t *obj = (kmem_object_t *) ptr;
+  kmem_object_t *head;
+  kmem_cpu_t *c;
+  uint64_t flag;
+
+  if (slab->cache != cache)
+    panic("kmem object freed to the wrong cache");
+
+  interrupt_disable_save(&flag);
+
+  if (slab->owner != get_pcpu_id()) {
+    /* back to the owner's remote list, drained on its next refill */
+    c = &cache->cpu[slab->owner];
+    head = atomic_load(&c->remote);
+    do {
+      obj->next = head;
+    } while (!atomic_cmp_xchg(&c->remote, &head, obj));
+  } else {
+    c = &cache->cpu[slab->owner];
+    obj->next = c->free;
+    c->free = obj;
+    if (++c->count > KMEM_CPU_MAX)
+      kmem_flush(cache, c);
+  }
+
+  interrupt_enable_restore(flag);
+}
@@ -20,35 +20,63 @@
 #include "debug.h"
 #include "mm/physical.h"
 #include "utils/screen.h"
-#include "utils/spinlock.h"
+#include "utils/qspinlock.h"
+#include "utils/bits.h"
+
+/* buddy backend, see tlsf.c for the MALLOC_TLSF one */
+#ifndef MALLOC_TLSF
 
 static buddy_bucket_t bsystem[BUDDY_ENTRIES];
-static void *mem_base = 0;
-static spinlock_t mm_lock = SPINLOCK_UNLOCKED;
+/* bit 'entry' is set iff bsystem[entry] is not empty */
+static uint32_t bucket_mask = 0;
+static qspinlock_t mm_lock = QSPINLOCK_UNLOCKED;
+
+static inline uint64_t arena_base(void *addr)
+{
+  return (uint64_t) addr & ~(MALLOC_ARENA_SIZE - 1);
+}
 
-/* return the minimum N that 2^N >= v */
-static uint8_t next_power2(uint32_t v)
+/* tag of the block starting at 'addr', in the tag array of its arena */
+static inline uint8_t *buddy_tag(void *addr)
 {
-  uint8_t cnt = BUDDY_MIN_ORDER;
-  uint32_t p = 1 << cnt;
+  uint8_t *tags = (uint8_t *) arena_base(addr);
 
-  if (v < BUDDY_MIN_BLK)
+  return &tags[((uint64_t) addr - (uint64_t) tags) >> BUDDY_MIN_ORDER];
+}
+
+/* return the minimum N that 2^N >= v, at least BUDDY_MIN_ORDER */
+static inline uint8_t next_power2(uint64_t v)
+{
+  if (v <= BUDDY_MIN_BLK)
     return BUDDY_MIN_ORDER;
 
-  while (p < v) {
-    p <<= 1;
-    cnt++;
-  }
-  return cnt;
+  return 64 - count_leading_zeros_bit64(v - 1);
+}
+
+/* put a free block in its bucket, lock held */
+static inline void bucket_add(uint8_t entry, buddy_list_t *blt)
+{
+  *buddy_tag(blt) = entry;
+  list_add(&blt->list, &bsystem[entry].ptr);
+  bsystem[entry].count++;
+  bucket_mask |= (uint32_t) 1 << entry;
+}
+
+/* take a free block out of its bucket, lock held */
+static inline void bucket_del(uint8_t entry, buddy_list_t *blt)
+{
+  list_del(&blt->list);
+  if (--bsystem[entry].count == 0)
+    bucket_mask &= ~((uint32_t) 1 << entry);
 }
 
 void check_buddy_table()
 {
   buddy_list_t *blt;
   uint8_t entry = 0;
-  uint32_t total = 0;
+  uint64_t total = 0;
 
-  spin_lock(&mm_lock);
+  qspin_lock(&mm_lock);
 
   while (1) {
     uint8_t counter = 0;
@@ -57,8 +85,8 @@ void check_buddy_table()
     printf("  Order: %u\n", entry + BUDDY_MIN_ORDER);
     total += bsystem[entry].count * bsystem[entry].size;
     list_for_each_entry(blt, &bsystem[entry].ptr, list) {
-      if (*(((uint8_t *) blt) + bsystem[entry].size - 1) != entry)
-        printf("ERROR: postamble not set for %llX\n", (uint64_t) blt);
+      if (*buddy_tag(blt) != entry)
+        printf("ERROR: tag not set for %llX\n", (uint64_t) blt);
       counter++;
     }
     if (counter != bsystem[entry].count)
@@ -69,8 +97,10 @@ void check_buddy_table()
         break;
   }
 
-  printf("Total free memory: %u\n", total);
-  spin_unlock(&mm_lock);
+  printf("Total free memory: %llu\n", total);
+  qspin_unlock(&mm_lock);
+
+  heap_dump_stats();
 }
 
 /* See if we can merge */
@@ -78,36 +108,29 @@ static uint8_t buddy_try_merge(buddy_list_t *blt, uint8_t entry)
 {
   uint8_t merge_count = 0;
 
-  if (bsystem[entry].count == 0)
+  if (!(bucket_mask & ((uint32_t) 1 << entry)))
     return 0;
 
   while (entry < BUDDY_ENTRIES - 1) {
     uint64_t buddy_addr = (uint64_t) blt;
+    uint64_t base = arena_base(blt);
     /* find the buddy */
-    buddy_addr -= (uint64_t) mem_base;
+    buddy_addr -= base;
     buddy_addr ^= bsystem[entry].size;
-    buddy_addr += (uint64_t) mem_base;
+    buddy_addr += base;
 
     /* merge */
-    if (*(uint8_t *) (buddy_addr + bsystem[entry].size - 1) == entry) {
+    if (*buddy_tag((void *) buddy_addr) == entry) {
       buddy_list_t *buddy = (buddy_list_t *) buddy_addr;
-      buddy_list_t *merged;
-      if (merge_count > 0) {
-        bsystem[entry].count--;
-        list_del(&blt->list);
-      }
-
-      bsystem[entry].count--;
-      list_del(&buddy->list);
+      if (merge_count > 0)
+        bucket_del(entry, blt);
+      bucket_del(entry, buddy);
 
       entry++;
-      merged = (blt < buddy) ? blt : buddy;
-      *(((uint8_t *) merged) + bsystem[entry].size - 1) = entry;
-      list_add(&merged->list, &bsystem[entry].ptr);
-      bsystem[entry].count++;
-
-      blt = merged;
+      blt = (blt < buddy) ? blt : buddy;
+      bucket_add(entry, blt);
       merge_count++;
+      heap_stats.merges++;
     } else
       break;
   }
@@ -125,109 +148,132 @@ void free(void *ptr)
   uint8_t entry;
   buddy_list_t *blt;
 
-  spin_lock(&mm_lock);
+  if ((uint64_t) ptr >= MALLOC_LARGE_BASE
+      && (uint64_t) ptr < MALLOC_LARGE_LIMIT) {
+    heap_free_large(ptr);
+    return;
+  }
+
+  heap_lock(&mm_lock);
 
-  addr -= sizeof(uint64_t);
-  entry = *addr;
-  if (*(addr + bsystem[entry].size - 1) != USED) {
+  entry = *buddy_tag(addr);
+  if (!(entry & USED)) {
     printf("%s: double free memory %llX\n", __func__, (uint64_t) ptr);
-    spin_unlock(&mm_lock);
+    qspin_unlock(&mm_lock);
     return;
   }
+  entry &= ~USED;
   blt = (buddy_list_t *) addr;
+  heap_stat_free(bsystem[entry].size);
 
   if (buddy_try_merge(blt, entry)) {
-    spin_unlock(&mm_lock);
+    qspin_unlock(&mm_lock);
     return;
   }
 
   /* no merge, add it to the list */
-  *(addr + bsystem[entry].size - 1) = entry;
-  list_add(&blt->list, &bsystem[entry].ptr);
-  bsystem[entry].count++;
-  spin_unlock(&mm_lock);
+  bucket_add(entry, blt);
+  qspin_unlock(&mm_lock);
 }
 
-static void buddy_split(buddy_bucket_t *bucket)
+static void buddy_split(uint8_t entry)
 {
-  uint8_t *post;
-  uint8_t entry;
   buddy_list_t *new_blt;
-  buddy_list_t *blt = list_first_entry(&bucket->ptr, buddy_list_t, list);
-  list_del(&blt->list);
-  bucket->count--;
+  buddy_list_t *blt = list_first_entry(&bsystem[entry].ptr, buddy_list_t,
+                                       list);
+  bucket_del(entry, blt);
+  heap_stats.splits++;
 
   /* Add two blocks to the lower order bucket */
-  bucket--;
-  bucket->count += 2;
-
-  new_blt = (buddy_list_t *) (((uint8_t *) blt) + bucket->size);
-  list_add(&new_blt->list, &bucket->ptr);
-  list_add(&blt->list, &bucket->ptr);
-  post = ((uint8_t *) new_blt) - 1;
-  entry = (uint8_t) (bucket - &bsystem[0]);
-  *post = entry;
-  post += bucket->size;
-  *post = entry;
+  entry--;
+  new_blt = (buddy_list_t *) (((uint8_t *) blt) + bsystem[entry].size);
+  bucket_add(entry, new_blt);
+  bucket_add(entry, blt);
+}
+
+/*
+ * put the free blocks of a new arena in the buckets: the first block
+ * of BUDDY_TAGS bytes holds the tags, each following power of two is
+ * one free block
+ */
+static void malloc_arena_init(uint64_t base)
+{
+  buddy_list_t *blt;
+  uint64_t size;
+  uint8_t entry;
+
+  *buddy_tag((void *) base) = (next_power2(BUDDY_TAGS) - BUDDY_MIN_ORDER)
+                              | USED;
+
+  for (size = BUDDY_TAGS; size < MALLOC_ARENA_SIZE; size <<= 1) {
+    blt = (buddy_list_t *) (base + size);
+    entry = next_power2(size) - BUDDY_MIN_ORDER;
+    bucket_add(entry, blt);
+  }
+}
+
+/* map one more arena, return false if out of memory, lock held */
+static bool malloc_grow(void)
+{
+  uint64_t base = heap_grow();
+
+  if (base == 0)
+    return false;
+
+  malloc_arena_init(base);
+  return true;
 }
 
 /*
  * Find the smallest block that will contain size and return it.
  * @param size The size of the data this allocation must be able to hold.
  */
-void *malloc(uint32_t size)
+void *malloc(uint64_t size)
 {
-  uint8_t *pre, *post;
+  void *site = __builtin_return_address(0);
   buddy_list_t *blt;
-  /*
-   * preamble: block order (8B), only the first 1B stores
-   * the order, the 8B is for alignment of the allocated data,
-   * a performance optimization
-   * postamble: block order (1B), if block is used, set to USED
-   */
-  uint8_t entry = next_power2(size + 9) - BUDDY_MIN_ORDER;
+  uint8_t entry, found;
+  uint32_t avail;
 
-  spin_lock(&mm_lock);
+  if (size > MALLOC_LARGE_MIN)
+    return heap_alloc_large(size, site);
 
-  if (bsystem[entry].count == 0) {
-    uint8_t split_count = 0;
+  entry = next_power2(size) - BUDDY_MIN_ORDER;
 
-    while (bsystem[entry].count == 0) {
-      entry++;
-      if (entry >= BUDDY_ENTRIES)
-        panic("out of memory");
-      split_count++;
-    }
+  heap_lock(&mm_lock);
 
-    while (split_count--) {
-      buddy_split(&bsystem[entry]);
-      entry--;
+  /* smallest non-empty bucket that fits */
+  avail = bucket_mask & (UINT32_MAX << entry);
+  if (avail == 0) {
+    /* a new arena has free blocks of every order a request can have */
+    if (!malloc_grow()) {
+      qspin_unlock(&mm_lock);
+      atomic_increment(&heap_stats.fails);
+      return NULL;
     }
+    avail = bucket_mask & (UINT32_MAX << entry);
   }
 
+  /* split down, at most BUDDY_ENTRIES - 1 times */
+  for (found = count_trailing_zeros_bit64(avail); found > entry; found--)
+    buddy_split(found);
+
   blt = list_first_entry(&bsystem[entry].ptr, buddy_list_t, list);
-  list_del(&blt->list);
-  bsystem[entry].count--;
-  /* preamble/postamble */
-  pre = (uint8_t *) blt;
-  post = pre + bsystem[entry].size - 1;
-  *pre = entry;
-  pre += sizeof(uint64_t);
-  *post = USED;
-
-  spin_unlock(&mm_lock);
-  return pre;
+  bucket_del(entry, blt);
+  *buddy_tag(blt) = entry | USED;
+
+  qspin_unlock(&mm_lock);
+  heap_stat_alloc(site, bsystem[entry].size);
+  return blt;
 }
 
 void malloc_init(void)
 {
-  uint64_t size, pages;
-  uint64_t paddr, vaddr;
-  buddy_list_t *initial;
+  uint64_t vaddr;
   uint32_t i;
   uint8_t list_count = BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1;
 
-  if ((1 << BUDDY_MIN_ORDER) < sizeof(buddy_list_t) + 1)
+  if ((1 << BUDDY_MIN_ORDER) < sizeof(buddy_list_t))
     panic("minimum block size too large");
 
   for (i = 0; i < list_count; i++) {
@@ -236,37 +282,13 @@ void malloc_init(void)
     INIT_LIST_HEAD(&bsystem[i].ptr);
   }
 
-  size = 1 << BUDDY_MAX_ORDER;
-  pages = 1 << (BUDDY_MAX_ORDER - PG_BITS);
-  vaddr = MALLOC_BASE;
-  /* malloc memory is not executable, set XD */
-  if (size < LARGE_PG_SIZE) {
-    paddr = alloc_phys_frames(pages);
-    if (paddr == 0)
-      panic("out of physical memory");
-    for (i = 0; i < pages; i++) {
-      vm_map_page_unrestricted(paddr, PGT_P | PGT_RW | PGT_XD, vaddr);
-      vaddr += PG_SIZE;
-      paddr += PG_SIZE;
-    }
-  } else {
-    paddr = alloc_phys_frames_aligned(pages, LARGE_PG_SIZE);
-    if (paddr == 0)
+  heap_init();
+
+  for (vaddr = MALLOC_BASE; vaddr < MALLOC_END; vaddr += MALLOC_ARENA_SIZE) {
+    if (!heap_map_arena(vaddr))
       panic("out of physical memory");
-    pages = 1 << (BUDDY_MAX_ORDER - LARGE_PG_BITS);
-    for (i = 0; i < pages; i++) {
-      vm_map_large_page_unrestricted(paddr, PGT_P | PGT_RW | PGT_XD | PDT_PS, vaddr);
-      vaddr += LARGE_PG_SIZE;
-      paddr += LARGE_PG_SIZE;
-    }
+    malloc_arena_init(vaddr);
   }
-  mem_base = (void *) MALLOC_BASE;
-
-  /* set up the initial buddy block */
-  initial = (buddy_list_t *) mem_base;
-  list_count--;
-  bsystem[list_count].count = 1;
-  list_add(&initial->list, &bsystem[list_count].ptr);
-  *(((uint8_t *) mem_base) + bsystem[list_count].size - 1)
-    = list_count;
 }
+
+#endif
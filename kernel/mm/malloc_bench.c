@@ -0,0 +1,95 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mm/malloc.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "utils/screen.h"
+
+/*
+ * MALLOC_BENCH: time every malloc/free of a fixed pseudo-random
+ * workload with rdtsc, build once per backend to compare them
+ */
+#ifdef MALLOC_BENCH
+
+#define BENCH_SLOTS 256
+#define BENCH_OPS 20000
+#define BENCH_SIZE_MAX 4096
+
+typedef struct _bench_stat {
+  uint64_t total;
+  uint64_t max;
+  uint64_t count;
+} bench_stat_t;
+
+static void *bench_slots[BENCH_SLOTS];
+
+static inline void bench_record(bench_stat_t *stat, uint64_t cycles)
+{
+  stat->total += cycles;
+  stat->count++;
+  if (cycles > stat->max)
+    stat->max = cycles;
+}
+
+void malloc_bench(void)
+{
+  bench_stat_t alloc_stat = {0, 0, 0}, free_stat = {0, 0, 0};
+  uint64_t seed = 1, start, flag, size;
+  uint32_t i, slot;
+
+  interrupt_disable_save(&flag);
+
+  for (i = 0; i < BENCH_OPS; i++) {
+    /* same LCG sequence for every backend */
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    slot = (seed >> 33) % BENCH_SLOTS;
+
+    if (bench_slots[slot]) {
+      start = rdtsc();
+      free(bench_slots[slot]);
+      bench_record(&free_stat, rdtsc() - start);
+      bench_slots[slot] = NULL;
+    } else {
+      size = ((seed >> 17) % BENCH_SIZE_MAX) + 1;
+      start = rdtsc();
+      bench_slots[slot] = malloc(size);
+      bench_record(&alloc_stat, rdtsc() - start);
+    }
+  }
+
+  for (slot = 0; slot < BENCH_SLOTS; slot++) {
+    if (bench_slots[slot])
+      free(bench_slots[slot]);
+    bench_slots[slot] = NULL;
+  }
+
+  interrupt_enable_restore(flag);
+
+#ifdef MALLOC_TLSF
+  printf("malloc bench (TLSF):\n");
+#else
+  printf("malloc bench (buddy):\n");
+#endif
+  printf("  malloc avg %llu max %llu cycles\n",
+         alloc_stat.total / alloc_stat.count, alloc_stat.max);
+  printf("  free avg %llu max %llu cycles\n",
+         free_stat.total / free_stat.count, free_stat.max);
+  heap_dump_stats();
+}
+
+#endif
@@ -18,12 +18,561 @@
 #include "mm/physical.h"
 #include "utils/bits.h"
 #include "utils/spinlock.h"
+#include "utils/qspinlock.h"
 #include "utils/screen.h"
+#include "utils/math.h"
+#include "percpu.h"
+#include "interrupt.h"
+#include "numa.h"
+#include "asm_string.h"
+#include "atomic.h"
+#include "cpu.h"
 
 
-static uint64_t mm_table[MM_TABLE_MAX] ALIGNED(PG_SIZE) = {0};
-static uint64_t mm_limit = 0, entry_end = 0;
-static spinlock_t phy_lock = SPINLOCK_UNLOCKED;
+/*
+ * all bitmaps below live in the metadata region mapped at
+ * PHYS_META_BASE, sized by physical_init from the memory map
+ */
+static uint64_t **mm_sections = NULL;
+static uint64_t mm_limit = 0;
+static uint64_t mm_words = 0;
+static qspinlock_t phy_lock = QSPINLOCK_UNLOCKED;
+
+/*
+ * PHYS_LOCKFREE: mm_table words and summary bits are claimed and
+ * released with atomics, see mm_claim_word, and phy_lock only guards
+ * the zone table; the free-extent index stays empty in this mode
+ */
+#ifdef PHYS_LOCKFREE
+#define phys_lock()
+#define phys_unlock()
+#else
+#define phys_lock() qspin_lock(&phy_lock)
+#define phys_unlock() qspin_unlock(&phy_lock)
+#endif
+
+/* sections with RAM, filled from the memory map before physical_init */
+static uint64_t mm_present[MM_SECTIONS_MAX / 64] = {0};
+
+/* page tables for mapping the metadata, handed out before physical_init */
+static uint64_t meta_next = 0;
+static uint64_t meta_end = 0;
+
+/*
+ * Free-extent index: a chunk is a large-page-sized group of frames,
+ * runs of fully free chunks are kept in lists by size class
+ * (floor(log2(size))), linked through the first chunk of each run
+ */
+typedef struct _phys_extent {
+  uint32_t size;  /* chunks */
+  uint32_t next;
+  uint32_t prev;
+} phys_extent_t;
+
+static uint64_t chunk_max = 0;
+static uint64_t chunk_words = 0;
+static uint16_t *chunk_free = NULL;
+static uint64_t *chunk_full = NULL;
+static phys_extent_t *extents = NULL;
+static uint32_t extent_heads[PHYS_EXTENT_CLASSES] = {
+  [0 ... PHYS_EXTENT_CLASSES - 1] = PHYS_EXTENT_NONE
+};
+static uint32_t extent_mask = 0;
+
+/* NUMA zones from SRAT, frame ranges [begin, end) owned by a node */
+typedef struct _phys_zone {
+  uint64_t begin;
+  uint64_t end;
+  uint8_t node;
+} phys_zone_t;
+
+static phys_zone_t phys_zones[PHYS_ZONES_MAX];
+static uint8_t num_zones = 0;
+
+/*
+ * boot-time reserved 2MB / 1GB frames, kept as stacks so that
+ * alloc/free are O(1) and never touch mm_table
+ */
+typedef struct _phys_huge_pool {
+  uint64_t *frames;
+  uint32_t count;
+  uint32_t max;
+  spinlock_t lock;
+} phys_huge_pool_t;
+
+static uint64_t huge_2m_frames[PHYS_HUGE_2M_RESERVE + 1];
+static uint64_t huge_1g_frames[PHYS_HUGE_1G_RESERVE + 1];
+static phys_huge_pool_t huge_pools[2] = {
+  {huge_2m_frames, 0, 0, SPINLOCK_UNLOCKED},
+  {huge_1g_frames, 0, 0, SPINLOCK_UNLOCKED}
+};
+
+/* zeroed frames, taken by VM setup and refilled by idle CPUs */
+typedef struct _phys_zero_pool {
+  uint64_t frames[PHYS_ZERO_POOL];
+  uint32_t count;
+  spinlock_t lock;
+} phys_zero_pool_t;
+
+static phys_zero_pool_t zero_pools[MAX_NUMA_NODES] = {
+  [0 ... MAX_NUMA_NODES - 1] = {.count = 0, .lock = SPINLOCK_UNLOCKED}
+};
+
+/*
+ * LLC page colors: frames whose addresses index the same cache sets
+ * share a color, color = frame number % phys_colors
+ */
+typedef struct _phys_color_pool {
+  uint64_t frames[PHYS_COLOR_POOL];
+  uint32_t count;
+} phys_color_pool_t;
+
+static uint8_t phys_colors = 1;
+static uint8_t color_next = 0;
+static uint64_t color_scan = MM_LOWMEM_FRAMES;
+static phys_color_pool_t color_pools[PHYS_COLORS_MAX];
+static spinlock_t color_lock = SPINLOCK_UNLOCKED;
+
+/*
+ * per-CPU magazines of single frames in front of phy_lock, usable
+ * once the per-CPU area of the running CPU is set up, see
+ * percpu_ready; no per-CPU constructor allocates frames
+ */
+static DEF_PER_CPU(uint16_t, phys_mag_count);
+static DEF_PER_CPU(uint64_t, phys_mag_frames[PHYS_MAG_SIZE]);
+#ifdef PHYS_LOCKFREE
+/* where the next refill starts, CPUs start spread over memory */
+static DEF_PER_CPU(uint64_t, phys_hint);
+#endif
+INIT_PER_CPU(phys_mag_count) {
+  percpu_write(phys_mag_count, 0);
+}
+
+/*
+ * bit i of level n is set iff word i of level n - 1 is non-zero,
+ * level 0 is mm_table itself and only reached through mm_word_ptr
+ */
+static uint64_t *mm_levels[MM_SUMMARY_LEVELS + 1];
+static uint64_t mm_level_words[MM_SUMMARY_LEVELS + 1];
+
+/* word of mm_table, NULL if its section has no RAM */
+static inline uint64_t *mm_word_ptr(uint64_t word)
+{
+  uint64_t *section;
+
+  if (word >= mm_words)
+    return NULL;
+
+  section = mm_sections[word / MM_SECTION_WORDS];
+  return section ? &section[word % MM_SECTION_WORDS] : NULL;
+}
+
+/* frames of a section without RAM are never free */
+static inline uint64_t mm_word(uint64_t word)
+{
+  uint64_t *p = mm_word_ptr(word);
+
+  return p ? *p : 0;
+}
+
+static inline uint64_t mm_level_word(uint8_t lv, uint64_t word)
+{
+  return lv ? mm_levels[lv][word] : mm_word(word);
+}
+
+/* bit 'i' of level 'lv' = (word 'i' of level 'lv' - 1 is non-zero) */
+static inline void summary_sync(uint8_t lv, uint64_t i)
+{
+#ifdef PHYS_LOCKFREE
+  uint64_t *p = &mm_levels[lv][i >> 6];
+  uint64_t bit = (uint64_t) 1 << (i & 63);
+
+  if (mm_level_word(lv - 1, i)) {
+    atomic_fetch_or(p, bit);
+    return;
+  }
+
+  /*
+   * a racing free sets its word before the summary bit,
+   * so look at the word again once the bit is cleared
+   */
+  atomic_fetch_and(p, ~bit);
+  if (mm_level_word(lv - 1, i))
+    atomic_fetch_or(p, bit);
+#else
+  if (mm_level_word(lv - 1, i))
+    bitmap64_set(mm_levels[lv], i);
+  else
+    bitmap64_clear(mm_levels[lv], i);
+#endif
+}
+
+/* refresh summary bits of mm_table words [first, last], lock held */
+static void summary_update(uint64_t first, uint64_t last)
+{
+  uint8_t lv;
+  uint64_t i;
+
+  for (lv = 1; lv <= MM_SUMMARY_LEVELS; lv++) {
+    for (i = first; i <= last; i++)
+      summary_sync(lv, i);
+    first >>= 6;
+    last >>= 6;
+  }
+}
+
+/*
+ * find the first set bit at or after 'bit' in level 'lv',
+ * MM_NONE if not found, lock held
+ */
+static uint64_t summary_find(uint8_t lv, uint64_t bit)
+{
+  uint64_t *map = mm_levels[lv];
+  uint64_t word = bit >> 6;
+  uint64_t data;
+
+  if (word >= mm_level_words[lv])
+    return MM_NONE;
+
+  data = mm_level_word(lv, word) & (UINT64_MAX << (bit & 63));
+  /* loops only in PHYS_LOCKFREE mode, on a stale summary bit */
+  while (data == 0) {
+    if (lv == MM_SUMMARY_LEVELS) {
+      /* top level is small enough for a linear scan */
+      do {
+        if (++word >= mm_level_words[lv])
+          return MM_NONE;
+      } while (map[word] == 0);
+    } else {
+      word = summary_find(lv + 1, word + 1);
+      if (word == MM_NONE)
+        return MM_NONE;
+    }
+    data = mm_level_word(lv, word);
+  }
+
+  return (word << 6) + count_trailing_zeros_bit64(data);
+}
+
+/* number of free frames starting from 'bit', at most 'max', lock held */
+static uint64_t mm_free_run(uint64_t bit, uint64_t max)
+{
+  uint64_t end = bit + max;
+  uint64_t i = bit >> 6;
+  uint64_t data = ~mm_word(i) & (UINT64_MAX << (bit & 63));
+
+  if (end > mm_limit)
+    end = mm_limit;
+
+  while (data == 0 && ((i + 1) << 6) < end) {
+    i++;
+    data = ~mm_word(i);
+  }
+
+  if (data != 0 && (i << 6) + count_trailing_zeros_bit64(data) < end)
+    end = (i << 6) + count_trailing_zeros_bit64(data);
+
+  return end > bit ? end - bit : 0;
+}
+
+static inline uint8_t extent_class(uint64_t size)
+{
+  return 63 - count_leading_zeros_bit64(size);
+}
+
+static void extent_insert(uint64_t head, uint64_t size)
+{
+  uint8_t cls = extent_class(size);
+
+  extents[head].size = size;
+  extents[head].prev = PHYS_EXTENT_NONE;
+  extents[head].next = extent_heads[cls];
+  if (extent_heads[cls] != PHYS_EXTENT_NONE)
+    extents[extent_heads[cls]].prev = head;
+  extent_heads[cls] = head;
+  extent_mask |= (uint32_t) 1 << cls;
+}
+
+static void extent_remove(uint64_t head)
+{
+  uint8_t cls = extent_class(extents[head].size);
+
+  if (extents[head].prev != PHYS_EXTENT_NONE)
+    extents[extents[head].prev].next = extents[head].next;
+  else
+    extent_heads[cls] = extents[head].next;
+  if (extents[head].next != PHYS_EXTENT_NONE)
+    extents[extents[head].next].prev = extents[head].prev;
+
+  if (extent_heads[cls] == PHYS_EXTENT_NONE)
+    extent_mask &= ~((uint32_t) 1 << cls);
+}
+
+/* first fully free chunk at or after 'chunk', chunk_max if none */
+static uint64_t chunk_next_full(uint64_t chunk)
+{
+  uint64_t i = chunk >> 6;
+  uint64_t data;
+
+  if (i >= chunk_words)
+    return chunk_max;
+
+  data = chunk_full[i] & (UINT64_MAX << (chunk & 63));
+  while (data == 0) {
+    if (++i >= chunk_words)
+      return chunk_max;
+    data = chunk_full[i];
+  }
+
+  return (i << 6) + count_trailing_zeros_bit64(data);
+}
+
+/* first chunk at or after 'chunk' that is not fully free */
+static uint64_t chunk_next_partial(uint64_t chunk)
+{
+  uint64_t i = chunk >> 6;
+  uint64_t data;
+
+  if (i >= chunk_words)
+    return chunk_max;
+
+  data = ~chunk_full[i] & (UINT64_MAX << (chunk & 63));
+  while (data == 0) {
+    if (++i >= chunk_words)
+      return chunk_max;
+    data = ~chunk_full[i];
+  }
+
+  return (i << 6) + count_trailing_zeros_bit64(data);
+}
+
+/* first chunk of the fully free run that 'chunk' belongs to */
+static uint64_t chunk_run_head(uint64_t chunk)
+{
+  uint64_t i = chunk >> 6;
+  uint64_t data = ~chunk_full[i] & (UINT64_MAX >> (63 - (chunk & 63)));
+
+  while (data == 0) {
+    if (i == 0)
+      return 0;
+    data = ~chunk_full[--i];
+  }
+
+  return (i << 6) + 64 - count_leading_zeros_bit64(data);
+}
+
+/*
+ * chunks [first, last] may have become or stopped being fully free,
+ * rebuild the extents around them, lock held
+ */
+static void extent_refresh(uint64_t first, uint64_t last)
+{
+  uint64_t lo, hi, c, end;
+
+  /* widen to the runs bordering [first, last], unchanged so far */
+  lo = first;
+  if (lo > 0 && bitmap64_check_bit(chunk_full, lo - 1))
+    lo = chunk_run_head(lo - 1);
+  hi = last;
+  if (hi + 1 < chunk_max && bitmap64_check_bit(chunk_full, hi + 1))
+    hi = chunk_next_partial(hi + 1) - 1;
+
+  for (c = chunk_next_full(lo); c <= hi; c = chunk_next_full(end)) {
+    end = chunk_next_partial(c);
+    extent_remove(c);
+  }
+
+  for (c = first; c <= last; c++) {
+    if (chunk_free[c] == PHYS_CHUNK_FRAMES)
+      bitmap64_set(chunk_full, c);
+    else
+      bitmap64_clear(chunk_full, c);
+  }
+
+  for (c = chunk_next_full(lo); c <= hi; c = chunk_next_full(end)) {
+    end = chunk_next_partial(c);
+    extent_insert(c, end - c);
+  }
+}
+
+/*
+ * smallest extent holding 'num' chunks from a multiple of 'align'
+ * chunks, return the first chunk to use or MM_NONE, lock held
+ */
+static uint64_t extent_find(uint64_t num, uint64_t align)
+{
+  uint32_t mask = extent_mask & (UINT32_MAX << extent_class(num));
+  uint32_t e, best;
+  uint64_t start;
+
+  while (mask) {
+    best = PHYS_EXTENT_NONE;
+    e = extent_heads[count_trailing_zeros_bit64(mask)];
+    for ( ; e != PHYS_EXTENT_NONE; e = extents[e].next) {
+      start = ceiling64(e, align);
+      if (start + num > e + extents[e].size)
+        continue;
+      if (best == PHYS_EXTENT_NONE || extents[e].size < extents[best].size)
+        best = e;
+    }
+
+    /* sizes in a higher class are all larger */
+    if (best != PHYS_EXTENT_NONE)
+      return ceiling64(best, align);
+    mask &= mask - 1;
+  }
+
+  return MM_NONE;
+}
+
+/*
+ * free (set) or take (clear) the frames of 'mask' in mm_table word,
+ * return true if its chunk became or stopped being fully free
+ */
+static bool mm_update_word(uint64_t word, uint64_t mask, bool free)
+{
+  uint64_t *p = mm_word_ptr(word);
+#ifndef PHYS_LOCKFREE
+  uint64_t chunk = word >> (PHYS_CHUNK_BITS - 6);
+  uint64_t old;
+  bool full;
+#endif
+
+  /* holes in the memory map stay taken */
+  if (p == NULL)
+    return false;
+
+#ifdef PHYS_LOCKFREE
+  if (free)
+    atomic_fetch_or(p, mask);
+  else
+    atomic_fetch_and(p, ~mask);
+  return false;
+#else
+  full = chunk_free[chunk] == PHYS_CHUNK_FRAMES;
+  old = *p;
+  if (free) {
+    *p = old | mask;
+    chunk_free[chunk] += count_bits64(mask & ~old);
+  } else {
+    *p = old & ~mask;
+    chunk_free[chunk] -= count_bits64(mask & old);
+  }
+
+  return full != (chunk_free[chunk] == PHYS_CHUNK_FRAMES);
+#endif
+}
+
+/* bits of mm_table 'word' within frames [begin, end) */
+static inline uint64_t mm_range_mask(uint64_t word, uint64_t begin,
+                                     uint64_t end)
+{
+  uint64_t mask = UINT64_MAX;
+
+  if (word == begin >> 6)
+    mask &= UINT64_MAX << (begin & 63);
+  if (word == (end - 1) >> 6)
+    mask &= UINT64_MAX >> ((-end) & 63);
+  return mask;
+}
+
+/*
+ * free or take frames [begin, begin + length), keeping the summary
+ * bitmaps and the extent index in sync, lock held
+ */
+static void mm_update_range(uint64_t begin, uint64_t length, bool free)
+{
+  uint64_t end = begin + length;
+  uint64_t word, last;
+  bool changed = false;
+
+  if (end > mm_limit)
+    end = mm_limit;
+  if (length == 0 || begin >= end)
+    return;
+
+  last = (end - 1) >> 6;
+  for (word = begin >> 6; word <= last; word++) {
+    if (mm_update_word(word, mm_range_mask(word, begin, end), free))
+      changed = true;
+  }
+
+  summary_update(begin >> 6, last);
+  if (changed)
+    extent_refresh(begin >> PHYS_CHUNK_BITS, (end - 1) >> PHYS_CHUNK_BITS);
+}
+
+static inline void mm_set_range(uint64_t begin, uint64_t length)
+{
+  mm_update_range(begin, length, true);
+}
+
+static inline void mm_clear_range(uint64_t begin, uint64_t length)
+{
+  mm_update_range(begin, length, false);
+}
+
+/*
+ * take the frames of 'mask' in mm_table 'word' if all of them are
+ * free, summary bits are left to the caller, lock held
+ */
+static bool mm_claim_word(uint64_t word, uint64_t mask)
+{
+#ifdef PHYS_LOCKFREE
+  uint64_t *p = mm_word_ptr(word);
+  uint64_t old;
+
+  if (p == NULL)
+    return mask == 0;
+
+  old = atomic_load(p);
+  do {
+    if ((old & mask) != mask)
+      return false;
+  } while (!atomic_cmp_xchg(p, &old, old & ~mask));
+
+  return true;
+#else
+  uint64_t chunk = word >> (PHYS_CHUNK_BITS - 6);
+
+  if ((mm_word(word) & mask) != mask)
+    return false;
+  if (mm_update_word(word, mask, false))
+    extent_refresh(chunk, chunk);
+  return true;
+#endif
+}
+
+/*
+ * take frames [begin, begin + length) if all of them are free, lock held;
+ * in PHYS_LOCKFREE mode losing a word to another CPU gives back the rest
+ */
+static bool mm_claim_range(uint64_t begin, uint64_t length)
+{
+#ifdef PHYS_LOCKFREE
+  uint64_t end = begin + length;
+  uint64_t first = begin >> 6, last = (end - 1) >> 6;
+  uint64_t word;
+
+  for (word = first; word <= last; word++) {
+    if (mm_claim_word(word, mm_range_mask(word, begin, end)))
+      continue;
+
+    while (word-- > first)
+      atomic_fetch_or(mm_word_ptr(word), mm_range_mask(word, begin, end));
+    /* summary bits may have been cleared while the words were taken */
+    summary_update(first, last);
+    return false;
+  }
+
+  summary_update(first, last);
+  return true;
+#else
+  /* callers found the frames free under the lock */
+  mm_clear_range(begin, length);
+  return true;
+#endif
+}
 
 /*
  * begin: start physical address
@@ -34,16 +583,15 @@ void physical_free_range(uint64_t begin, uint64_t length)
   uint64_t remain = begin % PG_SIZE;
   uint64_t end_remain = (begin + length) % PG_SIZE;
 
-  spin_lock(&phy_lock);
+  phys_lock();
 
   if (remain == 0)
-    bitmap64_set_range(mm_table, begin >> PG_BITS,
-                       (length - end_remain) >> PG_BITS);
+    mm_set_range(begin >> PG_BITS, (length - end_remain) >> PG_BITS);
   else
-    bitmap64_set_range(mm_table, (begin >> PG_BITS) + 1,
-                       (length - (PG_SIZE - remain) - end_remain) >> PG_BITS);
+    mm_set_range((begin >> PG_BITS) + 1,
+                 (length - (PG_SIZE - remain) - end_remain) >> PG_BITS);
 
-  spin_unlock(&phy_lock);
+  phys_unlock();
 }
 
 void physical_take_range(uint64_t begin, uint64_t length)
@@ -51,48 +599,189 @@ void physical_take_range(uint64_t begin, uint64_t length)
   uint64_t remain = begin % PG_SIZE;
   uint64_t end_remain = (begin + length) % PG_SIZE;
 
-  spin_lock(&phy_lock);
+  phys_lock();
 
   if (end_remain == 0)
-    bitmap64_clear_range(mm_table, begin >> PG_BITS, (length + remain) >> PG_BITS);
+    mm_clear_range(begin >> PG_BITS, (length + remain) >> PG_BITS);
   else
-    bitmap64_clear_range(mm_table, begin >> PG_BITS,
-                         (length + remain + PG_SIZE - end_remain) >> PG_BITS);
+    mm_clear_range(begin >> PG_BITS,
+                   (length + remain + PG_SIZE - end_remain) >> PG_BITS);
 
-  spin_unlock(&phy_lock);
+  phys_unlock();
 }
 
 bool physical_is_free(uint64_t addr)
 {
-  return bitmap64_check_bit(mm_table, addr >> PG_BITS);
+  uint64_t bit = addr >> PG_BITS;
+
+  if (bit >= mm_limit)
+    return false;
+  return get_bit64(mm_word(bit >> 6), bit & 63);
+}
+
+/* RAM in [begin, begin + length), before physical_init */
+void physical_add_section(uint64_t begin, uint64_t length)
+{
+  uint64_t s, last;
+
+  if (length == 0)
+    return;
+
+  last = (begin + length - 1) >> HUGE_PG_BITS;
+  for (s = begin >> HUGE_PG_BITS; s <= last && s < MM_SECTIONS_MAX; s++)
+    bitmap64_set(mm_present, s);
+}
+
+/* frames below 'limit' (bytes) the allocator can describe */
+static uint64_t mm_frames(uint64_t limit)
+{
+  uint64_t frames = limit >> PG_BITS;
+
+  if (frames > MM_SECTIONS_MAX * MM_SECTION_FRAMES)
+    frames = MM_SECTIONS_MAX * MM_SECTION_FRAMES;
+  return frames;
+}
+
+/*
+ * lay out the metadata for 'frames' frames from 'base',
+ * base == NULL only sizes it, return its size in bytes
+ */
+static uint64_t mm_layout(uint64_t frames, uint8_t *base)
+{
+  uint64_t words = (frames + 63) >> 6;
+  uint64_t sections = (frames + MM_SECTION_FRAMES - 1) >> MM_SECTION_BITS;
+  uint64_t chunks = (frames + PHYS_CHUNK_FRAMES - 1) >> PHYS_CHUNK_BITS;
+  uint64_t size, s;
+  uint8_t lv;
+
+  /* section table, then a page-aligned bitmap per section with RAM */
+  size = ceiling64(sections * sizeof(uint64_t *), PG_SIZE);
+  if (base)
+    mm_sections = (uint64_t **) base;
+  for (s = 0; s < sections; s++) {
+    if (!bitmap64_check_bit(mm_present, s))
+      continue;
+    if (base)
+      mm_sections[s] = (uint64_t *) (base + size);
+    size += MM_SECTION_WORDS * sizeof(uint64_t);
+  }
+
+  for (lv = 1; lv <= MM_SUMMARY_LEVELS; lv++) {
+    words = (words + 63) >> 6;
+    if (base) {
+      mm_levels[lv] = (uint64_t *) (base + size);
+      mm_level_words[lv] = words;
+    }
+    size += words * sizeof(uint64_t);
+  }
+
+  if (base)
+    chunk_full = (uint64_t *) (base + size);
+  size += ((chunks + 63) >> 6) * sizeof(uint64_t);
+  if (base)
+    extents = (phys_extent_t *) (base + size);
+  size += chunks * sizeof(phys_extent_t);
+  if (base)
+    chunk_free = (uint16_t *) (base + size);
+  size += chunks * sizeof(uint16_t);
+
+  return size;
+}
+
+/*
+ * bytes of physical memory physical_init needs for frames below
+ * 'limit', including the page tables mapping it
+ */
+uint64_t physical_meta_size(uint64_t limit)
+{
+  uint64_t pages = ceiling64(mm_layout(mm_frames(limit), NULL), PG_SIZE)
+                   >> PG_BITS;
+
+  if (pages << PG_BITS > PHYS_META_LIMIT - PHYS_META_BASE)
+    panic("Physical memory metadata too large");
+
+  /* PTs, plus a PDT and a PDPT */
+  return (pages + (pages + PG_TABLE_ENTRIES - 1) / PG_TABLE_ENTRIES + 2)
+         << PG_BITS;
 }
 
-void physical_set_limit(uint64_t limit)
+/*
+ * set up the allocator for frames below 'limit' with its metadata
+ * in the free physical memory [meta, meta + size), all frames taken
+ */
+void physical_init(uint64_t limit, uint64_t meta, uint64_t size)
 {
-  spin_lock(&phy_lock);
+  uint64_t frames = mm_frames(limit);
+  uint64_t bytes = mm_layout(frames, NULL);
+  uint64_t pages = ceiling64(bytes, PG_SIZE) >> PG_BITS;
+  uint64_t i;
+
+  if (frames < (limit >> PG_BITS))
+    printf("%s: memory above 0x%llX ignored\n", __func__,
+           frames << PG_BITS);
+
+  /* page tables for the mapping come from the tail of the region */
+  meta_next = meta + (pages << PG_BITS);
+  meta_end = meta + size;
+  for (i = 0; i < pages; i++)
+    vm_map_page_unrestricted(meta + (i << PG_BITS), PGT_P | PGT_RW | PGT_XD,
+                             PHYS_META_BASE + (i << PG_BITS));
+  meta_next = meta_end = 0;
+
+  memset((void *) PHYS_META_BASE, 0, pages << PG_BITS);
+  mm_layout(frames, (uint8_t *) PHYS_META_BASE);
 
   /* last available page + 1 */
-  mm_limit = limit >> PG_BITS;
-  entry_end = mm_limit >> 6;
-  if ((mm_limit & 63) > 0)
-    entry_end++;
+  mm_limit = frames;
+  mm_words = (frames + 63) >> 6;
+  mm_level_words[0] = mm_words;
+  chunk_max = (frames + PHYS_CHUNK_FRAMES - 1) >> PHYS_CHUNK_BITS;
+  chunk_words = (chunk_max + 63) >> 6;
+}
+
+/* memory [begin, begin + length) belongs to NUMA 'node' */
+void physical_add_zone(uint8_t node, uint64_t begin, uint64_t length)
+{
+  if (num_zones == PHYS_ZONES_MAX) {
+    printf("%s: zone table full, dropping 0x%llX\n", __func__, begin);
+    return;
+  }
+
+  qspin_lock(&phy_lock);
+  phys_zones[num_zones].begin = begin >> PG_BITS;
+  phys_zones[num_zones].end = (begin + length) >> PG_BITS;
+  phys_zones[num_zones].node = node;
+  num_zones++;
+  qspin_unlock(&phy_lock);
+}
+
+/* NUMA node owning frame 'bit', NUMA_NODE_NONE if not in any zone */
+static uint8_t phys_frame_node(uint64_t bit)
+{
+  uint8_t i;
+
+  for (i = 0; i < num_zones; i++) {
+    if (bit >= phys_zones[i].begin && bit < phys_zones[i].end)
+      return phys_zones[i].node;
+  }
 
-  spin_unlock(&phy_lock);
+  return NUMA_NODE_NONE;
 }
 
 /* mm_table checking */
 void physical_check_table(void)
 {
-  uint64_t i;
+  uint64_t i, word;
   int flag = 0;
-  for (i = 0; i < MM_TABLE_MAX; i++) {
-    if (mm_table[i] != UINT64_MAX && flag != 0) {
-      printf("mm_table[0x%llX]: %llX\n", i, mm_table[i]);
-      if (!(mm_table[i] & ((uint64_t) 0x1 << 63)))
+  for (i = 0; i < mm_words; i++) {
+    word = mm_word(i);
+    if (word != UINT64_MAX && flag != 0) {
+      printf("mm_table[0x%llX]: %llX\n", i, word);
+      if (!(word & ((uint64_t) 0x1 << 63)))
         flag = 0;
-    } else if (mm_table[i] != 0 && flag == 0) {
-      printf("mm_table[0x%llX]: %llX\n", i, mm_table[i]);
-      if (mm_table[i] & ((uint64_t) 0x1 << 63))
+    } else if (word != 0 && flag == 0) {
+      printf("mm_table[0x%llX]: %llX\n", i, word);
+      if (word & ((uint64_t) 0x1 << 63))
         flag = 1;
     }
   }
@@ -101,128 +790,258 @@ void physical_check_table(void)
 /* find the next free memory range after (including) 'current' */
 void physical_next_free_range(uint64_t current, uint64_t *start, uint64_t *size)
 {
-  uint64_t bit = current >> PG_BITS;
-  uint64_t end = ((bit + 64 - 1) / 64) * 64;
-  uint64_t i, count = 0;
+  uint64_t bit;
+
+  phys_lock();
 
-  if ((bit >> 6) >= entry_end) {
+  /* empty regions are skipped through the summary bitmaps */
+  bit = summary_find(0, current >> PG_BITS);
+  if (bit == MM_NONE || bit >= mm_limit) {
     *size = 0;
+    phys_unlock();
     return;
   }
 
-  for ( ; bit < end; bit++) {
-    if (bitmap64_check_bit(mm_table, bit))
+  *start = bit << PG_BITS;
+  *size = mm_free_run(bit, mm_limit - bit) << PG_BITS;
+
+  phys_unlock();
+}
+
+/*
+ * take up to 'num' - 'count' more frames of [bit, end) from mm_table,
+ * lowest address stored last in 'frames', return the new count, lock held
+ */
+static uint16_t phys_mag_take(uint64_t *frames, uint16_t num, uint16_t count,
+                              uint64_t bit, uint64_t end)
+{
+  uint64_t word, data, mask;
+  uint16_t taken;
+
+  if (end > mm_limit)
+    end = mm_limit;
+
+  while (count < num && bit < end) {
+    bit = summary_find(0, bit);
+    if (bit == MM_NONE || bit >= end)
+      break;
+
+    /* take as many frames as needed from this word at once */
+    word = bit >> 6;
+    data = mm_word(word) & mm_range_mask(word, bit, end);
+    mask = 0;
+    for (taken = count; data && taken < num; taken++) {
+      mask |= data & (-data);
+      data &= data - 1;
+    }
+
+    /* lost the word to another CPU in PHYS_LOCKFREE mode, look again */
+    if (!mm_claim_word(word, mask))
+      continue;
+    summary_update(word, word);
+
+    for ( ; mask; mask &= mask - 1) {
       count++;
-    else if (count > 0) {
-      *start = (bit - count) << PG_BITS;
-      *size = count << PG_BITS;
-      return;
+      frames[num - count] = ((word << 6) + count_trailing_zeros_bit64(mask))
+                            << PG_BITS;
     }
+    bit = (word + 1) << 6;
   }
 
-  i = end >> 6;
-  if (count == 0) {
-    for ( ; i < entry_end; i++) {
-      if (mm_table[i] != 0)
-        break;
-    }
+  return count;
+}
 
-    end = (i + 1) << 6;
-    for (bit = i << 6; bit < end; bit++) {
-      if (bitmap64_check_bit(mm_table, bit))
-        count++;
-      else if (count > 0) {
-        *start = (bit - count) << PG_BITS;
-        *size = count << PG_BITS;
-        //printf("bit %u, end %u, count %u, i %u\n", bit, end, count, i);
-        //printf("result %u, %llX\n", bitmap64_check_bit(mm_table, bit), mm_table[i]);
-        return;
-      }
-    }
-    i++;
+/* first frame the magazine refill of the running CPU looks at */
+static inline uint64_t phys_search_start(void)
+{
+#ifdef PHYS_LOCKFREE
+  uint64_t hint = percpu_read(phys_hint);
+
+  if (hint > MM_LOWMEM_FRAMES && hint < mm_limit)
+    return hint;
+  /* spread CPUs over memory so they rarely race for the same words */
+  return MM_LOWMEM_FRAMES
+         + (mm_limit - MM_LOWMEM_FRAMES) / MAX_CPUS * get_pcpu_id();
+#else
+  return MM_LOWMEM_FRAMES;
+#endif
+}
+
+/*
+ * take up to 'num' frames above 1MB, from the NUMA node of the
+ * running CPU first, return the number of frames taken
+ */
+static uint16_t phys_mag_refill(uint64_t *frames, uint16_t num)
+{
+  uint8_t node = numa_cpu_node(get_pcpu_id());
+  uint64_t start = phys_search_start();
+  uint64_t begin, end, from;
+  uint16_t count = 0;
+  uint8_t z;
+
+  phys_lock();
+
+  /* each range from 'start' if it lies inside, then its head */
+  for (z = 0; z < num_zones && count < num; z++) {
+    if (phys_zones[z].node != node)
+      continue;
+    begin = max64(phys_zones[z].begin, MM_LOWMEM_FRAMES);
+    end = phys_zones[z].end;
+    from = (start > begin && start < end) ? start : begin;
+    count = phys_mag_take(frames, num, count, from, end);
+    count = phys_mag_take(frames, num, count, begin, from);
   }
+  count = phys_mag_take(frames, num, count, start, mm_limit);
+  count = phys_mag_take(frames, num, count, MM_LOWMEM_FRAMES, start);
 
-  for ( ; i < entry_end; i++) {
-    if (mm_table[i] == UINT64_MAX)
-      count += 64;
-    else {
-      *start = ((i << 6) - count) << PG_BITS;
-      *size = (count + count_trailing_zeros_bit64(~mm_table[i])) << PG_BITS;
-      return;
-    }
+  phys_unlock();
+
+#ifdef PHYS_LOCKFREE
+  if (count)
+    percpu_write(phys_hint, (frames[num - count] >> PG_BITS) + 1);
+#endif
+
+  /* move the frames to the bottom of the magazine */
+  if (count < num) {
+    uint16_t i;
+    for (i = 0; i < count; i++)
+      frames[i] = frames[num - count + i];
   }
 
-  *start = ((i << 6) - count) << PG_BITS;
-  *size = count << PG_BITS;
+  return count;
+}
+
+/* give the 'num' frames at the bottom of the magazine back to mm_table */
+static void phys_mag_drain(uint64_t *frames, uint16_t num)
+{
+  uint16_t i;
+
+  phys_lock();
+  for (i = 0; i < num; i++)
+    mm_set_range(frames[i] >> PG_BITS, 1);
+  phys_unlock();
 }
 
 /* return page frame address, 0 if fail */
 uint64_t alloc_phys_frame(void)
 {
-  uint64_t i;
+  uint64_t bit, flag, frame;
+  uint64_t *frames;
+  uint16_t count;
+
+  /* page tables for the metadata mapping, before mm_table exists */
+  if (meta_next < meta_end) {
+    frame = meta_next;
+    meta_next += PG_SIZE;
+    return frame;
+  }
+
+  if (percpu_ready()) {
+    interrupt_disable_save(&flag);
+
+    frames = percpu_pointer(get_pcpu_id(), phys_mag_frames);
+    count = percpu_read(phys_mag_count);
+    if (count == 0)
+      count = phys_mag_refill(frames, PHYS_MAG_BATCH);
+
+    if (count == 0)
+      frame = 0;
+    else
+      frame = frames[--count];
+    percpu_write(phys_mag_count, count);
+
+    interrupt_enable_restore(flag);
+    return frame;
+  }
 
-  spin_lock(&phy_lock);
+  phys_lock();
 
   /* skip the first 1MB */
-  for (i = 4; i < entry_end; i++) {
-    if (mm_table[i]) {
-      uint8_t pos = 0;
-      uint64_t data = mm_table[i];
-      data = data & (-data);
-      data >>= 1;
-      while (data) {
-        data >>= 1;
-        pos++;
-      }
+  do {
+    bit = summary_find(0, MM_LOWMEM_FRAMES);
+    if (bit == MM_NONE || bit >= mm_limit) {
+      phys_unlock();
+      return 0;
+    }
+  } while (!mm_claim_range(bit, 1));
+
+  phys_unlock();
+  return bit << PG_BITS;
+}
+
+/*
+ * allocate from the free-extent index, for requests of at least one
+ * chunk or chunk-aligned ones, lock held
+ */
+static uint64_t alloc_phys_extent(uint64_t num, uint64_t align)
+{
+  uint64_t chunks = (num + PHYS_CHUNK_FRAMES - 1) >> PHYS_CHUNK_BITS;
+  uint64_t chunk = extent_find(chunks, (align + PHYS_CHUNK_FRAMES - 1)
+                                       >> PHYS_CHUNK_BITS);
+  uint64_t pos;
 
-      clear_bit64(&mm_table[i], pos);
-      spin_unlock(&phy_lock);
-      return ((i << 6) + pos) << PG_BITS;
+  if (chunk == MM_NONE)
+    return MM_NONE;
+
+  /* the tail of the last chunk stays free */
+  pos = chunk << PHYS_CHUNK_BITS;
+  mm_clear_range(pos, num);
+  return pos;
+}
+
+/*
+ * first-fit sweep of frames [pos, end) for 'num' frames starting at a
+ * multiple of 'pos_inc', take them and return the first, lock held
+ */
+static uint64_t phys_sweep(uint64_t pos, uint64_t end, uint64_t num,
+                           uint64_t pos_inc)
+{
+  uint64_t count;
+
+  if (end > mm_limit)
+    end = mm_limit;
+
+  pos = ceiling64(pos, pos_inc);
+  while (true) {
+    pos = summary_find(0, pos);
+    if (pos == MM_NONE)
+      break;
+    pos = ceiling64(pos, pos_inc);
+    if (pos + num > end)
+      break;
+
+    count = mm_free_run(pos, num);
+    if (count == num) {
+      if (mm_claim_range(pos, num))
+        return pos;
+      /* raced with another CPU in PHYS_LOCKFREE mode */
+      continue;
     }
+
+    /* frame (pos + count) is taken */
+    pos += count + 1;
   }
 
-  spin_unlock(&phy_lock);
-  return 0;
+  return MM_NONE;
 }
 
 /* allocate contiguous page frames */
 uint64_t alloc_phys_frames(uint64_t num)
 {
-  uint64_t i, pos, count;
-
-  spin_lock(&phy_lock);
+  uint64_t pos = MM_NONE;
 
-  /* skip the first 1MB */
-  for (i = 4, pos = 256; i < entry_end; ) {
-    if (mm_table[i]) {
-      uint64_t cur;
-
-      while (bitmap64_get(mm_table, pos) == 0)
-        pos++;
-
-      cur = pos;
-      count = 0;
-      while (count < num && bitmap64_get(mm_table, cur)) {
-        cur++;
-        count++;
-      }
+  phys_lock();
 
-      if (count == num) {
-        bitmap64_clear_range(mm_table, pos, num);
-        spin_unlock(&phy_lock);
-        return pos << PG_BITS;
-      }
+  /* best fit from the extent index, bitmap sweep as fallback */
+  if (num >= PHYS_CHUNK_FRAMES)
+    pos = alloc_phys_extent(num, 1);
 
-      pos = cur + 1;
-      i = pos >> 6;
-    } else {
-      i++;
-      pos += 64;
-    }
-  }
+  /* skip the first 1MB */
+  if (pos == MM_NONE)
+    pos = phys_sweep(MM_LOWMEM_FRAMES, mm_limit, num, 1);
 
-  spin_unlock(&phy_lock);
-  return 0;
+  phys_unlock();
+  return pos == MM_NONE ? 0 : pos << PG_BITS;
 }
 
 /*
@@ -232,101 +1051,463 @@ uint64_t alloc_phys_frames(uint64_t num)
  */
 uint64_t alloc_phys_frames_aligned(uint64_t num, uint64_t align)
 {
-  uint64_t i, pos, count;
+  uint64_t pos = MM_NONE;
   uint64_t pos_inc = align >> PG_BITS;
-  uint64_t i_inc = pos_inc >> 6;
 
-  spin_lock(&phy_lock);
+  if (pos_inc == 0)
+    pos_inc = 1;
 
-  /* skip the first 1MB */
-  i = i_inc <= 4 ? 4 : i_inc;
-  pos = i << 6;
-
-  for ( ; i < entry_end; ) {
-    if (mm_table[i]) {
-      uint64_t cur;
-      uint64_t remain;
-
-      while (pos < mm_limit && bitmap64_get(mm_table, pos) == 0)
-        pos += pos_inc;
-
-      cur = pos;
-      count = 0;
-      while (count < num && cur < mm_limit && bitmap64_get(mm_table, cur)) {
-        cur++;
-        count++;
-      }
+  phys_lock();
 
-      if (count == num) {
-        bitmap64_clear_range(mm_table, pos, num);
-        spin_unlock(&phy_lock);
-        return pos << PG_BITS;
-      }
+  if (num >= PHYS_CHUNK_FRAMES || pos_inc >= PHYS_CHUNK_FRAMES)
+    pos = alloc_phys_extent(num, pos_inc);
 
-      if (cur >= mm_limit) {
-        /* out of memory */
-        spin_unlock(&phy_lock);
-        return 0;
-      }
+  /* no suitable extent, sweep the bitmap, skipping the first 1MB */
+  if (pos == MM_NONE)
+    pos = phys_sweep(MM_LOWMEM_FRAMES, mm_limit, num, pos_inc);
 
-      pos = cur + 1;
-      remain = pos % pos_inc;
-      if (remain != 0)
-        pos = pos + pos_inc - remain;
-      i = pos >> 6;
-    } else {
-      if (i_inc > 0) {
-        i += i_inc;
-        pos += pos_inc;
-      } else {
-        i += 1;
-        pos += 64;
-      }
+  phys_unlock();
+  return pos == MM_NONE ? 0 : pos << PG_BITS;
+}
+
+/*
+ * allocate contiguous page frames from the zones of 'node', then of
+ * the other nodes by distance, aligned to 'align' bytes (align == 2^n),
+ * return 0 if no zone has room
+ */
+static uint64_t alloc_phys_frames_zones(uint64_t num, uint64_t align,
+                                        uint8_t node)
+{
+  uint8_t order[MAX_NUMA_NODES];
+  uint8_t num_nodes, i, j;
+  uint64_t pos = MM_NONE;
+  uint64_t pos_inc = align >> PG_BITS;
+
+  if (pos_inc == 0)
+    pos_inc = 1;
+
+  num_nodes = numa_node_order(node, order);
+
+  phys_lock();
+
+  for (i = 0; i < num_nodes && pos == MM_NONE; i++) {
+    for (j = 0; j < num_zones && pos == MM_NONE; j++) {
+      if (phys_zones[j].node == order[i])
+        pos = phys_sweep(max64(phys_zones[j].begin, MM_LOWMEM_FRAMES),
+                         phys_zones[j].end, num, pos_inc);
     }
   }
 
-  spin_unlock(&phy_lock);
-  return 0;
+  phys_unlock();
+  return pos == MM_NONE ? 0 : pos << PG_BITS;
+}
+
+/* return page frame address on (or nearest to) NUMA 'node', 0 if fail */
+uint64_t alloc_phys_frame_node(uint8_t node)
+{
+  return alloc_phys_frames_node(1, node);
+}
+
+/* allocate contiguous page frames on (or nearest to) NUMA 'node' */
+uint64_t alloc_phys_frames_node(uint64_t num, uint8_t node)
+{
+  uint64_t frame = 0;
+
+  if (num_zones)
+    frame = alloc_phys_frames_zones(num, PG_SIZE, node);
+
+  /* no SRAT, or memory not described by it */
+  return frame ? frame : alloc_phys_frames(num);
+}
+
+/* aligned contiguous page frames on (or nearest to) NUMA 'node' */
+uint64_t alloc_phys_frames_aligned_node(uint64_t num, uint64_t align,
+                                        uint8_t node)
+{
+  uint64_t frame = 0;
+
+  if (num_zones)
+    frame = alloc_phys_frames_zones(num, align, node);
+
+  return frame ? frame : alloc_phys_frames_aligned(num, align);
 }
 
 /* return page frame address below 1MB, 0 if fail */
 uint64_t alloc_phys_frame_lowmem(void)
 {
-  uint64_t i;
+  uint64_t bit;
+
+  phys_lock();
+
+  do {
+    bit = summary_find(0, 0);
+    if (bit == MM_NONE || bit >= MM_LOWMEM_FRAMES) {
+      phys_unlock();
+      return 0;
+    }
+  } while (!mm_claim_range(bit, 1));
+
+  phys_unlock();
+  return bit << PG_BITS;
+}
+
+void free_phys_frame(uint64_t frame)
+{
+  uint64_t flag;
+  uint64_t *frames;
+  uint16_t count, i;
+
+  /*
+   * low memory goes straight back to alloc_phys_frame_lowmem,
+   * frames of other NUMA nodes straight back to their zones
+   */
+  if (percpu_ready() && (frame >> PG_BITS) >= MM_LOWMEM_FRAMES
+      && (num_zones == 0 || phys_frame_node(frame >> PG_BITS)
+          == numa_cpu_node(get_pcpu_id()))) {
+    interrupt_disable_save(&flag);
+
+    frames = percpu_pointer(get_pcpu_id(), phys_mag_frames);
+    count = percpu_read(phys_mag_count);
+    if (count == PHYS_MAG_SIZE) {
+      /* keep the recently freed (cache-hot) frames on top */
+      phys_mag_drain(frames, PHYS_MAG_BATCH);
+      count -= PHYS_MAG_BATCH;
+      for (i = 0; i < count; i++)
+        frames[i] = frames[i + PHYS_MAG_BATCH];
+    }
+    frames[count++] = frame;
+    percpu_write(phys_mag_count, count);
+
+    interrupt_enable_restore(flag);
+    return;
+  }
+
+  phys_lock();
+  mm_set_range(frame >> PG_BITS, 1);
+  phys_unlock();
+}
+
+void free_phys_frames(uint64_t frame, uint64_t num)
+{
+  phys_lock();
+  mm_set_range(frame >> PG_BITS, num);
+  phys_unlock();
+}
+
+static phys_huge_pool_t *huge_pool(uint64_t size)
+{
+  if (size == LARGE_PG_SIZE)
+    return &huge_pools[0];
+  if (size == HUGE_PG_SIZE)
+    return &huge_pools[1];
+
+  panic("Unsupported huge frame size");
+  return NULL;
+}
+
+static void huge_pool_fill(phys_huge_pool_t *pool, uint64_t size,
+                           uint32_t num)
+{
+  uint64_t frame;
+
+  while (pool->count < num) {
+    frame = alloc_phys_frames_aligned(size >> PG_BITS, size);
+    if (frame == 0)
+      break;
+    pool->frames[pool->count++] = frame;
+  }
+  pool->max = pool->count;
+
+  if (pool->count < num)
+    printf("%s: reserved %u of %u frames of 0x%llX\n", __func__,
+           pool->count, num, size);
+}
+
+/*
+ * carve the huge-frame pools out of free memory, before anything
+ * fragments it; 1GB first so 2MB frames do not break up 1GB runs
+ */
+void physical_reserve_huge(void)
+{
+  huge_pool_fill(huge_pool(HUGE_PG_SIZE), HUGE_PG_SIZE, PHYS_HUGE_1G_RESERVE);
+  huge_pool_fill(huge_pool(LARGE_PG_SIZE), LARGE_PG_SIZE,
+                 PHYS_HUGE_2M_RESERVE);
+}
+
+/* 'size' is LARGE_PG_SIZE or HUGE_PG_SIZE, return 0 if the pool is empty */
+uint64_t alloc_phys_huge_frame(uint64_t size)
+{
+  phys_huge_pool_t *pool = huge_pool(size);
+  uint64_t frame = 0;
+
+  spin_lock(&pool->lock);
+  if (pool->count)
+    frame = pool->frames[--pool->count];
+  spin_unlock(&pool->lock);
+
+  return frame;
+}
+
+void free_phys_huge_frame(uint64_t frame, uint64_t size)
+{
+  phys_huge_pool_t *pool = huge_pool(size);
+
+  spin_lock(&pool->lock);
+  if (pool->count == pool->max)
+    panic("Huge frame pool overflow");
+  pool->frames[pool->count++] = frame;
+  spin_unlock(&pool->lock);
+}
+
+uint64_t phys_huge_frames_left(uint64_t size)
+{
+  return huge_pool(size)->count;
+}
+
+static void zero_phys_frame(uint64_t frame)
+{
+  memset(phys_to_virt(frame), 0, PG_SIZE);
+}
+
+/* return a zeroed page frame on (or nearest to) 'node', 0 if fail */
+uint64_t alloc_zeroed_phys_frame_node(uint8_t node)
+{
+  phys_zero_pool_t *pool = &zero_pools[node];
+  uint64_t frame = 0;
+
+  spin_lock(&pool->lock);
+  if (pool->count)
+    frame = pool->frames[--pool->count];
+  spin_unlock(&pool->lock);
+
+  if (frame)
+    return frame;
+
+  /* pool ran dry, zero inline */
+  frame = alloc_phys_frame_node(node);
+  if (frame)
+    zero_phys_frame(frame);
+  return frame;
+}
+
+/* zeroed page frame on the node of the running CPU */
+uint64_t alloc_zeroed_phys_frame(void)
+{
+  return alloc_zeroed_phys_frame_node(numa_cpu_node(get_pcpu_id()));
+}
+
+/*
+ * zero one frame into the pool of the running CPU's node,
+ * for idle loops, return false if the pool is already full
+ */
+bool physical_zero_refill(void)
+{
+  phys_zero_pool_t *pool = &zero_pools[numa_cpu_node(get_pcpu_id())];
+  uint64_t frame;
+
+  /* unlocked peek, a stale value only costs one extra frame */
+  if (pool->count >= PHYS_ZERO_POOL)
+    return false;
+
+  frame = alloc_phys_frame();
+  if (frame == 0)
+    return false;
+  zero_phys_frame(frame);
+
+  spin_lock(&pool->lock);
+  if (pool->count < PHYS_ZERO_POOL) {
+    pool->frames[pool->count++] = frame;
+    frame = 0;
+  }
+  spin_unlock(&pool->lock);
 
-  spin_lock(&phy_lock);
-
-  for (i = 0; i < 4; i++) {
-    if (mm_table[i]) {
-      uint8_t pos = 0;
-      uint64_t data = mm_table[i];
-      data = data & (-data);
-      data >>= 1;
-      while (data) {
-        data >>= 1;
-        pos++;
+  if (frame)
+    free_phys_frame(frame);
+  return true;
+}
+
+/*
+ * size the page colors from the last-level cache in CPUID leaf 4:
+ * one color per page of a cache way, capped at PHYS_COLORS_MAX,
+ * a capped color still never shares sets with another one
+ */
+void physical_init_colors(void)
+{
+  uint32_t eax, ebx, ecx, max_leaf, i;
+  uint64_t way_size = 0, colors;
+  uint32_t level = 0, ways = 0;
+
+  cpuid(0, 0, &max_leaf, NULL, NULL, NULL);
+  if (max_leaf < 4)
+    return;
+
+  for (i = 0; i < 16; i++) {
+    cpuid(4, i, &eax, &ebx, &ecx, NULL);
+    /* no more caches */
+    if ((eax & 0x1F) == 0)
+      break;
+    /* skip instruction caches */
+    if ((eax & 0x1F) == 2 || ((eax >> 5) & 0x7) < level)
+      continue;
+
+    level = (eax >> 5) & 0x7;
+    ways = (ebx >> 22) + 1;
+    /* partitions * line size * sets */
+    way_size = (uint64_t) (((ebx >> 12) & 0x3FF) + 1) * ((ebx & 0xFFF) + 1)
+               * ((uint64_t) ecx + 1);
+  }
+
+  colors = way_size >> PG_BITS;
+  if (colors > PHYS_COLORS_MAX)
+    colors = PHYS_COLORS_MAX;
+  if (colors > 1)
+    phys_colors = (uint64_t) 1 << (63 - count_leading_zeros_bit64(colors));
+
+  printf("LLC: L%u, %u ways, %u page colors\n", level, ways, phys_colors);
+}
+
+uint8_t phys_num_colors(void)
+{
+  return phys_colors;
+}
+
+/* color mask with every color set */
+uint64_t phys_all_colors(void)
+{
+  if (phys_colors == PHYS_COLORS_MAX)
+    return UINT64_MAX;
+  return ((uint64_t) 1 << phys_colors) - 1;
+}
+
+uint8_t phys_frame_color(uint64_t frame)
+{
+  return (frame >> PG_BITS) & (phys_colors - 1);
+}
+
+/*
+ * bits of an mm_table word for the colors in 'colors' whose stack
+ * has room for all the frames a word can hold, color_lock held
+ */
+static uint64_t color_word_mask(uint64_t colors)
+{
+  uint32_t per_word = 64 / phys_colors;
+  uint8_t c, shift;
+
+  for (c = 0; c < phys_colors; c++) {
+    if (color_pools[c].count + per_word > PHYS_COLOR_POOL)
+      colors &= ~((uint64_t) 1 << c);
+  }
+
+  for (shift = phys_colors; shift < 64; shift <<= 1)
+    colors |= colors << shift;
+  return colors;
+}
+
+/*
+ * move about PHYS_COLOR_BATCH free frames with a color in 'colors'
+ * from mm_table to the color stacks, sweeping on from the last refill,
+ * return the number of frames moved, color_lock held
+ */
+static uint32_t phys_color_refill(uint64_t colors)
+{
+  uint64_t start = color_scan, end = mm_limit;
+  uint64_t bit = start, word, data, wmask;
+  phys_color_pool_t *pool;
+  uint32_t taken = 0;
+
+  wmask = color_word_mask(colors);
+
+  phys_lock();
+
+  while (taken < PHYS_COLOR_BATCH && wmask) {
+    bit = summary_find(0, bit);
+    if (bit == MM_NONE || bit >= end) {
+      /* wrap around once */
+      if (end != mm_limit || start == MM_LOWMEM_FRAMES)
+        break;
+      end = start;
+      bit = MM_LOWMEM_FRAMES;
+      continue;
+    }
+
+    word = bit >> 6;
+    data = mm_word(word) & wmask & mm_range_mask(word, bit, end);
+    if (data) {
+      /* lost the word to another CPU in PHYS_LOCKFREE mode, look again */
+      if (!mm_claim_word(word, data))
+        continue;
+      summary_update(word, word);
+
+      for ( ; data; data &= data - 1) {
+        bit = (word << 6) + count_trailing_zeros_bit64(data);
+        pool = &color_pools[bit & (phys_colors - 1)];
+        pool->frames[pool->count++] = bit << PG_BITS;
+        taken++;
       }
+      wmask = color_word_mask(colors);
+    }
+    bit = (word + 1) << 6;
+  }
+
+  phys_unlock();
+
+  color_scan = (bit < mm_limit && bit > MM_LOWMEM_FRAMES) ? bit
+               : MM_LOWMEM_FRAMES;
+  return taken;
+}
 
-      clear_bit64(&mm_table[i], pos);
-      spin_unlock(&phy_lock);
-      return ((i << 6) + pos) << PG_BITS;
+/* pop a frame of the next color in 'colors' with one, 0 if none, lock held */
+static uint64_t color_pop(uint64_t colors)
+{
+  phys_color_pool_t *pool;
+  uint8_t i, c;
+
+  for (i = 0; i < phys_colors; i++) {
+    c = (color_next + i) & (phys_colors - 1);
+    pool = &color_pools[c];
+    if (get_bit64(colors, c) && pool->count) {
+      /* take the colors in turn, spreading over all of their sets */
+      color_next = c + 1;
+      return pool->frames[--pool->count];
     }
   }
 
-  spin_unlock(&phy_lock);
   return 0;
 }
 
-void free_phys_frame(uint64_t frame)
+/* return a page frame with a color in 'colors', 0 if fail */
+uint64_t alloc_phys_frame_color(uint64_t colors)
 {
-  spin_lock(&phy_lock);
-  bitmap64_set(mm_table, frame >> PG_BITS);
-  spin_unlock(&phy_lock);
+  uint64_t frame;
+
+  colors &= phys_all_colors();
+  if (colors == 0)
+    return 0;
+  /* no restriction, skip the color stacks */
+  if (colors == phys_all_colors())
+    return alloc_phys_frame();
+
+  spin_lock(&color_lock);
+  frame = color_pop(colors);
+  if (frame == 0 && phys_color_refill(colors))
+    frame = color_pop(colors);
+  spin_unlock(&color_lock);
+
+  return frame;
 }
 
-void free_phys_frames(uint64_t frame, uint64_t num)
+/* free a frame from alloc_phys_frame_color to its color stack */
+void free_phys_frame_color(uint64_t frame)
 {
-  spin_lock(&phy_lock);
-  bitmap64_set_range(mm_table, frame >> PG_BITS, num);
-  spin_unlock(&phy_lock);
+  phys_color_pool_t *pool = &color_pools[phys_frame_color(frame)];
+
+  spin_lock(&color_lock);
+  if (pool->count < PHYS_COLOR_POOL) {
+    pool->frames[pool->count++] = frame;
+    frame = 0;
+  }
+  spin_unlock(&color_lock);
+
+  if (frame)
+    free_phys_frame(frame);
 }
@@ -0,0 +1,329 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mm/malloc.h"
+#include "vm.h"
+#include "debug.h"
+#include "utils/screen.h"
+#include "utils/qspinlock.h"
+#include "utils/bits.h"
+#include "utils/math.h"
+
+/*
+ * Two-Level Segregated Fit, O(1) malloc and free: a request is mapped
+ * to a (fl, sl) list, rounded up so that any block on a list at or
+ * above it fits, and the first such list comes from two bit scans
+ */
+#ifdef MALLOC_TLSF
+
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[TLSF_FL_COUNT];
+static tlsf_block_t *tlsf_heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+static qspinlock_t mm_lock = QSPINLOCK_UNLOCKED;
+
+static inline uint64_t block_size(tlsf_block_t *block)
+{
+  return block->size & ~(uint64_t) TLSF_FLAGS;
+}
+
+static inline tlsf_block_t *block_next(tlsf_block_t *block)
+{
+  return (tlsf_block_t *) ((uint8_t *) block + block_size(block));
+}
+
+static inline void *block_to_ptr(tlsf_block_t *block)
+{
+  return (uint8_t *) block + TLSF_HDR_SIZE;
+}
+
+static inline tlsf_block_t *ptr_to_block(void *ptr)
+{
+  return (tlsf_block_t *) ((uint8_t *) ptr - TLSF_HDR_SIZE);
+}
+
+/* list of blocks of 'size' bytes */
+static inline void tlsf_mapping(uint64_t size, uint32_t *fl, uint32_t *sl)
+{
+  uint32_t bit;
+
+  if (size < TLSF_SMALL) {
+    *fl = 0;
+    *sl = size / (TLSF_SMALL / TLSF_SL_COUNT);
+  } else {
+    bit = 63 - count_leading_zeros_bit64(size);
+    *sl = (size >> (bit - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+    *fl = bit - TLSF_FL_SHIFT + 1;
+  }
+}
+
+/* first list whose blocks all have at least 'size' bytes */
+static inline void tlsf_mapping_search(uint64_t size, uint32_t *fl,
+                                       uint32_t *sl)
+{
+  uint32_t bit;
+
+  if (size >= TLSF_SMALL) {
+    bit = 63 - count_leading_zeros_bit64(size);
+    size += ((uint64_t) 1 << (bit - TLSF_SL_BITS)) - 1;
+  }
+  tlsf_mapping(size, fl, sl);
+}
+
+static void tlsf_insert(tlsf_block_t *block)
+{
+  uint32_t fl, sl;
+
+  tlsf_mapping(block_size(block), &fl, &sl);
+  block->prev_free = NULL;
+  block->next_free = tlsf_heads[fl][sl];
+  if (block->next_free)
+    block->next_free->prev_free = block;
+  tlsf_heads[fl][sl] = block;
+  fl_bitmap |= (uint32_t) 1 << fl;
+  sl_bitmap[fl] |= (uint32_t) 1 << sl;
+}
+
+static void tlsf_remove(tlsf_block_t *block)
+{
+  uint32_t fl, sl;
+
+  tlsf_mapping(block_size(block), &fl, &sl);
+  if (block->prev_free)
+    block->prev_free->next_free = block->next_free;
+  else
+    tlsf_heads[fl][sl] = block->next_free;
+  if (block->next_free)
+    block->next_free->prev_free = block->prev_free;
+
+  if (tlsf_heads[fl][sl] == NULL) {
+    sl_bitmap[fl] &= ~((uint32_t) 1 << sl);
+    if (sl_bitmap[fl] == 0)
+      fl_bitmap &= ~((uint32_t) 1 << fl);
+  }
+}
+
+/* free block of at least 'size' bytes, NULL if none, lock held */
+static tlsf_block_t *tlsf_find(uint64_t size)
+{
+  uint32_t fl, sl, map;
+
+  tlsf_mapping_search(size, &fl, &sl);
+  if (fl >= TLSF_FL_COUNT)
+    return NULL;
+
+  map = sl_bitmap[fl] & (UINT32_MAX << sl);
+  if (map == 0) {
+    /* next non-empty first level */
+    if (fl + 1 >= TLSF_FL_COUNT)
+      return NULL;
+    map = fl_bitmap & (UINT32_MAX << (fl + 1));
+    if (map == 0)
+      return NULL;
+    fl = count_trailing_zeros_bit64(map);
+    map = sl_bitmap[fl];
+  }
+  sl = count_trailing_zeros_bit64(map);
+
+  return tlsf_heads[fl][sl];
+}
+
+/* mark 'block' free or used, in its own header and in the next one */
+static inline void block_set_free(tlsf_block_t *block, bool free)
+{
+  tlsf_block_t *next = block_next(block);
+
+  if (free) {
+    block->size |= TLSF_FREE;
+    next->size |= TLSF_PREV_FREE;
+    next->prev_phys = block;
+  } else {
+    block->size &= ~(uint64_t) TLSF_FREE;
+    next->size &= ~(uint64_t) TLSF_PREV_FREE;
+  }
+}
+
+/*
+ * cut 'block' to 'size' bytes, the rest becomes a free block,
+ * return the rest, NULL if too small to split
+ */
+static tlsf_block_t *block_split(tlsf_block_t *block, uint64_t size)
+{
+  tlsf_block_t *rest;
+  uint64_t rest_size = block_size(block) - size;
+
+  if (rest_size < TLSF_MIN_BLOCK)
+    return NULL;
+
+  rest = (tlsf_block_t *) ((uint8_t *) block + size);
+  rest->size = rest_size;
+  block->size = size | (block->size & TLSF_FLAGS);
+  rest->prev_phys = block;
+  block_set_free(rest, true);
+  tlsf_insert(rest);
+  return rest;
+}
+
+/*
+ * one free block over the arena at 'base', closed by a used,
+ * zero-sized sentinel header that stops merging at the arena end
+ */
+static void tlsf_arena_init(uint64_t base)
+{
+  tlsf_block_t *block = (tlsf_block_t *) base;
+  tlsf_block_t *sentinel = (tlsf_block_t *) (base + MALLOC_ARENA_SIZE
+                                             - TLSF_HDR_SIZE);
+
+  block->size = MALLOC_ARENA_SIZE - TLSF_HDR_SIZE;
+  block->prev_phys = NULL;
+  sentinel->size = 0;
+  block_set_free(block, true);
+  tlsf_insert(block);
+}
+
+/* free block of 'size' bytes or more, growing the heap, lock held */
+static tlsf_block_t *tlsf_get(uint64_t size)
+{
+  tlsf_block_t *block = tlsf_find(size);
+  uint64_t base;
+
+  if (block == NULL) {
+    base = heap_grow();
+    if (base == 0)
+      return NULL;
+    tlsf_arena_init(base);
+    block = tlsf_find(size);
+  }
+
+  return block;
+}
+
+/*
+ * return memory of at least 'size' bytes, 16B aligned; power-of-two
+ * requests from a page to half of MALLOC_LARGE_MIN are aligned to
+ * their size, as kmem slabs expect from the buddy
+ */
+void *malloc(uint64_t size)
+{
+  void *site = __builtin_return_address(0);
+  tlsf_block_t *block, *aligned;
+  uint64_t need, align = 0, gap;
+
+  if (size > MALLOC_LARGE_MIN)
+    return heap_alloc_large(size, site);
+
+  need = ceiling64(size + TLSF_HDR_SIZE, TLSF_ALIGN);
+  if (need < TLSF_MIN_BLOCK)
+    need = TLSF_MIN_BLOCK;
+  if (size >= PG_SIZE && size <= (MALLOC_LARGE_MIN >> 1)
+      && (size & (size - 1)) == 0)
+    align = size;
+
+  heap_lock(&mm_lock);
+
+  /* room to cut a free block off the front when aligning */
+  block = tlsf_get(align ? need + align + TLSF_MIN_BLOCK : need);
+  if (block == NULL) {
+    qspin_unlock(&mm_lock);
+    atomic_increment(&heap_stats.fails);
+    return NULL;
+  }
+  tlsf_remove(block);
+
+  if (align) {
+    gap = ceiling64((uint64_t) block_to_ptr(block), align)
+          - (uint64_t) block_to_ptr(block);
+    if (gap && gap < TLSF_MIN_BLOCK)
+      gap += align;
+    if (gap) {
+      /* the front stays free, continue with the aligned block */
+      aligned = (tlsf_block_t *) ((uint8_t *) block + gap);
+      aligned->size = block_size(block) - gap;
+      block->size = gap | (block->size & TLSF_FLAGS);
+      aligned->prev_phys = block;
+      block_set_free(block, true);
+      tlsf_insert(block);
+      block = aligned;
+      heap_stats.splits++;
+    }
+  }
+
+  if (block_split(block, need))
+    heap_stats.splits++;
+  block_set_free(block, false);
+  need = block_size(block);
+
+  qspin_unlock(&mm_lock);
+  heap_stat_alloc(site, need);
+  return block_to_ptr(block);
+}
+
+/* free the given pointer, merging with free physical neighbours */
+void free(void *ptr)
+{
+  tlsf_block_t *block = ptr_to_block(ptr);
+  tlsf_block_t *next;
+
+  if ((uint64_t) ptr >= MALLOC_LARGE_BASE
+      && (uint64_t) ptr < MALLOC_LARGE_LIMIT) {
+    heap_free_large(ptr);
+    return;
+  }
+
+  heap_lock(&mm_lock);
+
+  if (block->size & TLSF_FREE) {
+    printf("%s: double free memory %llX\n", __func__, (uint64_t) ptr);
+    qspin_unlock(&mm_lock);
+    return;
+  }
+  heap_stat_free(block_size(block));
+
+  if (block->size & TLSF_PREV_FREE) {
+    tlsf_block_t *prev = block->prev_phys;
+    tlsf_remove(prev);
+    prev->size += block_size(block);
+    block = prev;
+    heap_stats.merges++;
+  }
+
+  next = block_next(block);
+  if (next->size & TLSF_FREE) {
+    tlsf_remove(next);
+    block->size += block_size(next);
+    heap_stats.merges++;
+  }
+
+  block_set_free(block, true);
+  tlsf_insert(block);
+
+  qspin_unlock(&mm_lock);
+}
+
+void malloc_init(void)
+{
+  uint64_t vaddr;
+
+  heap_init();
+
+  for (vaddr = MALLOC_BASE; vaddr < MALLOC_END; vaddr += MALLOC_ARENA_SIZE) {
+    if (!heap_map_arena(vaddr))
+      panic("out of physical memory");
+    tlsf_arena_init(vaddr);
+  }
+}
+
+#endif
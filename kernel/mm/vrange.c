@@ -0,0 +1,353 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mm/vrange.h"
+#include "debug.h"
+#include "utils/math.h"
+
+static vrange_node_t node_pool[VRANGE_NODES];
+static vrange_node_t *node_free = NULL;
+static uint32_t node_left = 0;
+static bool node_ready = false;
+static spinlock_t node_lock = SPINLOCK_UNLOCKED;
+
+/* take 'num' nodes from the pool into 'out', false if not enough */
+static bool node_get(vrange_node_t **out, uint32_t num)
+{
+  uint32_t i;
+
+  spin_lock(&node_lock);
+  if (!node_ready) {
+    for (i = 0; i < VRANGE_NODES; i++) {
+      node_pool[i].left = node_free;
+      node_free = &node_pool[i];
+    }
+    node_left = VRANGE_NODES;
+    node_ready = true;
+  }
+
+  if (node_left < num) {
+    spin_unlock(&node_lock);
+    return false;
+  }
+  for (i = 0; i < num; i++) {
+    out[i] = node_free;
+    node_free = node_free->left;
+  }
+  node_left -= num;
+  spin_unlock(&node_lock);
+
+  return true;
+}
+
+static void node_put(vrange_node_t *node)
+{
+  if (node == NULL)
+    return;
+
+  spin_lock(&node_lock);
+  node->left = node_free;
+  node_free = node;
+  node_left++;
+  spin_unlock(&node_lock);
+}
+
+static inline uint32_t node_height(vrange_node_t *node)
+{
+  return node ? node->height : 0;
+}
+
+static inline uint64_t node_max(vrange_node_t *node)
+{
+  return node ? node->max : 0;
+}
+
+/* recompute height and max from the children */
+static void node_fix(vrange_node_t *node)
+{
+  uint32_t hl = node_height(node->left), hr = node_height(node->right);
+  uint64_t ml = node_max(node->left), mr = node_max(node->right);
+
+  node->height = (hl > hr ? hl : hr) + 1;
+  node->max = node->size;
+  if (ml > node->max)
+    node->max = ml;
+  if (mr > node->max)
+    node->max = mr;
+}
+
+static vrange_node_t *rotate_right(vrange_node_t *node)
+{
+  vrange_node_t *l = node->left;
+
+  node->left = l->right;
+  l->right = node;
+  node_fix(node);
+  node_fix(l);
+  return l;
+}
+
+static vrange_node_t *rotate_left(vrange_node_t *node)
+{
+  vrange_node_t *r = node->right;
+
+  node->right = r->left;
+  r->left = node;
+  node_fix(node);
+  node_fix(r);
+  return r;
+}
+
+/* restore the AVL balance of 'node', return the subtree root */
+static vrange_node_t *node_balance(vrange_node_t *node)
+{
+  uint32_t hl, hr;
+
+  node_fix(node);
+  hl = node_height(node->left);
+  hr = node_height(node->right);
+
+  if (hl > hr + 1) {
+    if (node_height(node->left->right) > node_height(node->left->left))
+      node->left = rotate_left(node->left);
+    return rotate_right(node);
+  }
+  if (hr > hl + 1) {
+    if (node_height(node->right->left) > node_height(node->right->right))
+      node->right = rotate_right(node->right);
+    return rotate_left(node);
+  }
+
+  return node;
+}
+
+static vrange_node_t *tree_insert(vrange_node_t *root, vrange_node_t *node)
+{
+  if (root == NULL) {
+    node->left = node->right = NULL;
+    node_fix(node);
+    return node;
+  }
+
+  if (node->start < root->start)
+    root->left = tree_insert(root->left, node);
+  else
+    root->right = tree_insert(root->right, node);
+
+  return node_balance(root);
+}
+
+/* unlink the leftmost node of 'root' into '*min' */
+static vrange_node_t *tree_remove_min(vrange_node_t *root,
+                                      vrange_node_t **min)
+{
+  if (root->left == NULL) {
+    *min = root;
+    return root->right;
+  }
+
+  root->left = tree_remove_min(root->left, min);
+  return node_balance(root);
+}
+
+/* unlink the node starting at 'start', it must be in the tree */
+static vrange_node_t *tree_remove(vrange_node_t *root, uint64_t start)
+{
+  vrange_node_t *min;
+
+  if (start < root->start)
+    root->left = tree_remove(root->left, start);
+  else if (start > root->start)
+    root->right = tree_remove(root->right, start);
+  else {
+    if (root->right == NULL)
+      return root->left;
+    root->right = tree_remove_min(root->right, &min);
+    min->left = root->left;
+    min->right = root->right;
+    return node_balance(min);
+  }
+
+  return node_balance(root);
+}
+
+static vrange_node_t *tree_find(vrange_node_t *root, uint64_t start)
+{
+  while (root && root->start != start)
+    root = start < root->start ? root->left : root->right;
+  return root;
+}
+
+/* closest nodes below and above 'addr' */
+static void tree_neighbours(vrange_node_t *root, uint64_t addr,
+                            vrange_node_t **prev, vrange_node_t **next)
+{
+  *prev = *next = NULL;
+  while (root) {
+    if (root->start < addr) {
+      *prev = root;
+      root = root->right;
+    } else {
+      *next = root;
+      root = root->left;
+    }
+  }
+}
+
+/* lowest free range of at least 'need' bytes */
+static vrange_node_t *tree_first_fit(vrange_node_t *root, uint64_t need)
+{
+  while (root && root->max >= need) {
+    if (node_max(root->left) >= need)
+      root = root->left;
+    else if (root->size >= need)
+      return root;
+    else
+      root = root->right;
+  }
+
+  return NULL;
+}
+
+void vrange_init(vrange_t *vr, uint64_t base, uint64_t limit,
+                 uint64_t granularity)
+{
+  vrange_node_t *node;
+
+  spin_lock_init(&vr->lock);
+  vr->free = vr->used = NULL;
+  vr->granularity = granularity;
+
+  if (!node_get(&node, 1))
+    panic("out of vrange nodes");
+  node->start = base;
+  node->size = limit - base;
+  vr->free = tree_insert(NULL, node);
+}
+
+/*
+ * 'size' bytes aligned to 'align' (0 for the granularity), rounded up
+ * to the granularity, return the address or 0 if out of space
+ */
+uint64_t vrange_alloc(vrange_t *vr, uint64_t size, uint64_t align)
+{
+  vrange_node_t *nodes[2], *node, *drop = NULL;
+  uint64_t need, addr, end;
+
+  size = ceiling64(size, vr->granularity);
+  if (align < vr->granularity)
+    align = vr->granularity;
+  /* any range this large holds an aligned block */
+  need = size + align - vr->granularity;
+
+  /* one for the used range, one spare for a split */
+  if (size == 0 || !node_get(nodes, 2))
+    return 0;
+
+  spin_lock(&vr->lock);
+
+  node = tree_first_fit(vr->free, need);
+  if (node == NULL) {
+    spin_unlock(&vr->lock);
+    node_put(nodes[0]);
+    node_put(nodes[1]);
+    return 0;
+  }
+
+  vr->free = tree_remove(vr->free, node->start);
+  addr = ceiling64(node->start, align);
+  end = node->start + node->size;
+
+  /* the head stays in 'node', the tail takes the spare */
+  if (addr + size < end) {
+    nodes[1]->start = addr + size;
+    nodes[1]->size = end - addr - size;
+    vr->free = tree_insert(vr->free, nodes[1]);
+    nodes[1] = NULL;
+  }
+  if (addr > node->start) {
+    node->size = addr - node->start;
+    vr->free = tree_insert(vr->free, node);
+  } else
+    drop = node;
+
+  nodes[0]->start = addr;
+  nodes[0]->size = size;
+  vr->used = tree_insert(vr->used, nodes[0]);
+
+  spin_unlock(&vr->lock);
+  node_put(nodes[1]);
+  node_put(drop);
+
+  return addr;
+}
+
+/* size of the used range at 'addr', 0 if none starts there */
+uint64_t vrange_size(vrange_t *vr, uint64_t addr)
+{
+  vrange_node_t *node;
+  uint64_t size = 0;
+
+  spin_lock(&vr->lock);
+  node = tree_find(vr->used, addr);
+  if (node)
+    size = node->size;
+  spin_unlock(&vr->lock);
+
+  return size;
+}
+
+/* release the range at 'addr', return its size, 0 if not allocated */
+uint64_t vrange_free(vrange_t *vr, uint64_t addr)
+{
+  vrange_node_t *node, *prev, *next;
+  uint64_t size;
+
+  spin_lock(&vr->lock);
+
+  node = tree_find(vr->used, addr);
+  if (node == NULL) {
+    spin_unlock(&vr->lock);
+    return 0;
+  }
+  vr->used = tree_remove(vr->used, addr);
+  size = node->size;
+
+  /* coalesce with the free ranges on both sides */
+  tree_neighbours(vr->free, addr, &prev, &next);
+  if (next && next->start == addr + size) {
+    vr->free = tree_remove(vr->free, next->start);
+    node->size += next->size;
+  } else
+    next = NULL;
+  if (prev && prev->start + prev->size == addr) {
+    vr->free = tree_remove(vr->free, prev->start);
+    prev->size += node->size;
+    vr->free = tree_insert(vr->free, prev);
+    prev = node;
+  } else {
+    vr->free = tree_insert(vr->free, node);
+    prev = NULL;
+  }
+
+  spin_unlock(&vr->lock);
+  node_put(next);
+  node_put(prev);
+
+  return size;
+}
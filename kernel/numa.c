@@ -0,0 +1,137 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "numa.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "mm/physical.h"
+#include "utils/screen.h"
+
+/* topology from SRAT/SLIT, everything is node 0 without them */
+static uint8_t apic_nodes[256] = {0};
+static uint8_t cpu_nodes[MAX_CPUS] = {0};
+static uint8_t node_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+static bool has_slit = false;
+/* bit n set iff node n owns a CPU or memory */
+static uint8_t node_mask = 1;
+
+static uint8_t numa_node_of_domain(uint32_t domain)
+{
+  if (domain >= MAX_NUMA_NODES) {
+    printf("NUMA: proximity domain %u folded into node 0\n", domain);
+    return 0;
+  }
+
+  node_mask |= 1 << domain;
+  return (uint8_t) domain;
+}
+
+void numa_add_cpu(uint32_t apic_id, uint32_t domain)
+{
+  /* x2APIC ids beyond xAPIC range are not used by this kernel */
+  if (apic_id >= 256)
+    return;
+
+  apic_nodes[apic_id] = numa_node_of_domain(domain);
+}
+
+void numa_add_memory(uint32_t domain, uint64_t begin, uint64_t length)
+{
+  physical_add_zone(numa_node_of_domain(domain), begin, length);
+}
+
+/* SLIT entry, localities are proximity domains */
+void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance)
+{
+  if (from >= MAX_NUMA_NODES || to >= MAX_NUMA_NODES)
+    return;
+
+  node_distance[from][to] = distance;
+  has_slit = true;
+}
+
+void numa_set_cpu_node(uint16_t cpu, uint8_t node)
+{
+  cpu_nodes[cpu] = node;
+}
+
+uint8_t numa_node_of_apic(uint32_t apic_id)
+{
+  if (apic_id >= 256)
+    return 0;
+
+  return apic_nodes[apic_id];
+}
+
+uint8_t numa_cpu_node(uint16_t cpu)
+{
+  return cpu_nodes[cpu];
+}
+
+/* node of the running CPU, usable before its per-CPU area exists */
+uint8_t numa_local_node(void)
+{
+  uint32_t ebx;
+
+  /* initial APIC ID */
+  cpuid(1, 0, NULL, &ebx, NULL, NULL);
+  return numa_node_of_apic(ebx >> 24);
+}
+
+static uint8_t numa_distance(uint8_t from, uint8_t to)
+{
+  if (has_slit && node_distance[from][to])
+    return node_distance[from][to];
+
+  return from == to ? NUMA_DISTANCE_LOCAL : NUMA_DISTANCE_REMOTE;
+}
+
+/*
+ * fill 'order' with the present nodes, nearest to 'node' first,
+ * return the number of nodes
+ */
+uint8_t numa_node_order(uint8_t node, uint8_t *order)
+{
+  uint8_t i, j, num = 0, n;
+
+  for (n = 0; n < MAX_NUMA_NODES; n++) {
+    if (!(node_mask & (1 << n)))
+      continue;
+
+    /* insertion sort, ties broken by node id */
+    for (i = num; i > 0; i--) {
+      j = order[i - 1];
+      if (numa_distance(node, j) <= numa_distance(node, n))
+        break;
+      order[i] = j;
+    }
+    order[i] = n;
+    num++;
+  }
+
+  return num;
+}
+
+/* after ACPI parsing on BSP, APs set their node in percpu_init */
+void numa_init(void)
+{
+  numa_set_cpu_node(get_pcpu_id(), numa_local_node());
+
+  if (node_mask != 1)
+    printf("NUMA: node mask 0x%x, BSP on node %u\n", node_mask,
+           numa_cpu_node(get_pcpu_id()));
+}
@@ -0,0 +1,131 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "utils/spinlock.h"
+#include "utils/qspinlock.h"
+#include "utils/screen.h"
+#include "percpu.h"
+#include "acpi.h"
+#include "cpu.h"
+
+/*
+ * LOCK_BENCH: every CPU hammers one ticket lock, then one queued
+ * lock, at boot; a handoff is timed from the release on one CPU to
+ * the acquisition on another. Meant for QEMU with -smp 16.
+ */
+#ifdef LOCK_BENCH
+
+#define BENCH_ROUNDS 20000
+/* cycles of work in the critical section and between acquisitions */
+#define BENCH_HOLD 200
+#define BENCH_GAP 400
+
+typedef struct _bench_stat {
+  uint64_t total;
+  uint64_t max;
+  uint64_t count;
+  uint64_t handoffs;
+  uint64_t last_release;
+  uint16_t last_owner;
+} bench_stat_t;
+
+static spinlock_t bench_ticket = SPINLOCK_UNLOCKED;
+static qspinlock_t bench_queued = QSPINLOCK_UNLOCKED;
+static bench_stat_t ticket_stat, queued_stat;
+static uint64_t ticket_cycles, queued_cycles;
+static uint32_t bench_arrived = 0;
+
+/* wait for all CPUs, 'round' counts the barriers passed so far */
+static void bench_barrier(uint32_t round)
+{
+  atomic_increment(&bench_arrived);
+  while (atomic_load(&bench_arrived) < round * g_cpus)
+    pause();
+}
+
+static inline void bench_delay(uint64_t cycles)
+{
+  uint64_t start = rdtsc();
+
+  while (rdtsc() - start < cycles)
+    pause();
+}
+
+/* with the lock held */
+static void bench_enter(bench_stat_t *stat, uint16_t cpu)
+{
+  uint64_t handoff;
+
+  if (stat->count != 0 && stat->last_owner != cpu) {
+    handoff = rdtsc() - stat->last_release;
+    stat->handoffs++;
+    stat->total += handoff;
+    if (handoff > stat->max)
+      stat->max = handoff;
+  }
+  stat->count++;
+  stat->last_owner = cpu;
+  bench_delay(BENCH_HOLD);
+  stat->last_release = rdtsc();
+}
+
+static void bench_print(const char *name, bench_stat_t *stat, uint64_t cycles)
+{
+  printf("  %s: %llu cycles per acquisition, %llu handoffs avg %llu "
+         "max %llu cycles\n", name, cycles / stat->count, stat->handoffs,
+         stat->handoffs ? stat->total / stat->handoffs : 0, stat->max);
+}
+
+/* run on every CPU once all of them are up */
+void lock_bench(void)
+{
+  uint16_t cpu = get_pcpu_id();
+  uint64_t start;
+  uint32_t i;
+
+  bench_barrier(1);
+  start = rdtsc();
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    spin_lock(&bench_ticket);
+    bench_enter(&ticket_stat, cpu);
+    spin_unlock(&bench_ticket);
+    bench_delay(BENCH_GAP);
+  }
+  bench_barrier(2);
+  if (cpu == 0)
+    ticket_cycles = rdtsc() - start;
+
+  bench_barrier(3);
+  start = rdtsc();
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    qspin_lock(&bench_queued);
+    bench_enter(&queued_stat, cpu);
+    qspin_unlock(&bench_queued);
+    bench_delay(BENCH_GAP);
+  }
+  bench_barrier(4);
+
+  if (cpu == 0) {
+    queued_cycles = rdtsc() - start;
+    printf("lock bench, %u CPUs:\n", g_cpus);
+    bench_print("ticket", &ticket_stat, ticket_cycles);
+    bench_print("queued", &queued_stat, queued_cycles);
+  }
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*                       RTV Real-Time Hypervisor
+ * Copyright (C) 2017  Ying Ye
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "utils/qspinlock.h"
+#include "percpu.h"
+#include "debug.h"
+
+static DEF_PER_CPU(qspin_node_t, qspin_nodes[QSPIN_NESTING]);
+static DEF_PER_CPU(uint8_t, qspin_count);
+
+/*
+ * Until percpu_init, FS is still the data segment and per-CPU nodes
+ * cannot be reached. Only one CPU at a time runs that early (the BSP,
+ * then each AP while the BSP waits for it), so they share these.
+ */
+static qspin_node_t boot_nodes[QSPIN_NESTING];
+static uint8_t boot_count = 0;
+
+#define BOOT_CPU MAX_CPUS
+
+static inline uint32_t qspin_encode_tail(uint16_t cpu, uint8_t idx)
+{
+  return ((uint32_t) (cpu + 1) << 2) | idx;
+}
+
+static qspin_node_t *qspin_decode_tail(uint32_t tail)
+{
+  uint16_t cpu = (tail >> 2) - 1;
+  qspin_node_t *nodes;
+
+  if (cpu == BOOT_CPU)
+    return &boot_nodes[tail & 3];
+
+  nodes = percpu_pointer(cpu, qspin_nodes);
+  return &nodes[tail & 3];
+}
+
+void qspin_lock_slow(qspinlock_t *lock)
+{
+  qspin_node_t *node, *prev;
+  uint16_t cpu;
+  uint8_t idx;
+  uint32_t tail, old;
+  uint64_t data;
+  bool percpu = percpu_ready();
+
+  /*
+   * take the next free node; an interrupt between the read and the
+   * write gives its nodes back before returning here
+   */
+  if (percpu) {
+    cpu = get_pcpu_id();
+    idx = percpu_read(qspin_count);
+    percpu_write(qspin_count, (uint8_t) (idx + 1));
+    node = percpu_pointer(cpu, qspin_nodes);
+  } else {
+    cpu = BOOT_CPU;
+    idx = boot_count++;
+    node = boot_nodes;
+  }
+  if (idx >= QSPIN_NESTING)
+    panic("qspinlock nested too deep");
+  node += idx;
+
+  node->next = NULL;
+  node->wait = 1;
+  tail = qspin_encode_tail(cpu, idx);
+
+  /* queue up, then wait for the previous waiter to hand over */
+  old = atomic_exchange(&lock->obj.tail, tail);
+  if (old != 0) {
+    prev = qspin_decode_tail(old);
+    atomic_store(&prev->next, node);
+    while (atomic_load(&node->wait))
+      pause();
+  }
+
+  /* head of the queue, the only CPU spinning on the lock word */
+  while (atomic_load(&lock->obj.locked))
+    pause();
+
+  /* last in the queue: take the lock and empty the queue at once */
+  data = (uint64_t) tail << 32;
+  if (!atomic_cmp_xchg(&lock->data, &data, 1)) {
+    /* a new tail is set, the fast path cannot take the lock anymore */
+    atomic_store(&lock->obj.locked, 1);
+    while ((prev = atomic_load(&node->next)) == NULL)
+      pause();
+    atomic_store(&prev->wait, 0);
+  }
+
+  if (percpu)
+    percpu_write(qspin_count, idx);
+  else
+    boot_count--;
+}
@@ -17,7 +17,7 @@
 
 #include <stdarg.h>
 #include "types.h"
-#include "utils/spinlock.h"
+#include "utils/qspinlock.h"
 
 /*  The number of columns. */
 #define COLUMNS                 80
@@ -32,7 +32,7 @@ uint8_t *frameBuf = (uint8_t *) 0xB8000;
 static uint16_t xpos;
 /*  Save the Y position */
 static uint16_t ypos;
-static spinlock_t scr_lock = SPINLOCK_UNLOCKED;
+static qspinlock_t scr_lock = QSPINLOCK_UNLOCKED;
 
 static void _putchar(char c)
 {
@@ -232,11 +232,11 @@ void printf(const char *fmt, ...)
   va_list args;
   va_start(args, fmt);
 
-  spin_lock(&scr_lock);
+  qspin_lock(&scr_lock);
 
   vprintf(_putchar, fmt, args);
 
-  spin_unlock(&scr_lock);
+  qspin_unlock(&scr_lock);
 
   va_end(args);
 }